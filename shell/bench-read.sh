@@ -0,0 +1,31 @@
+#! /bin/bash
+
+# Compare lines/sec of wish's batch file readers, parsing only (-n), and of
+# loading the same lines from a compiled script.
+# usage: ./bench-read.sh [lines]
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+lines=${1:-5000000}
+
+batch=$(mktemp)
+trap 'rm -f $batch $batch.wshc' EXIT
+yes 'ls -la /tmp > /tmp/output & grep -n pattern file1 file2 | wc -l' | head -n $lines > $batch
+
+for reader in stdio mmap; do
+    start=$(date +%s%N)
+    ./wish -n -r $reader $batch
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000 ))
+    echo "$reader: $lines lines in $(( elapsed / 1000 )) ms, $(( lines * 1000000 / elapsed )) lines/sec"
+done
+
+./wish --compile $batch -o $batch.wshc
+start=$(date +%s%N)
+./wish -n $batch.wshc
+end=$(date +%s%N)
+elapsed=$(( (end - start) / 1000 ))
+echo "compiled: $lines lines in $(( elapsed / 1000 )) ms, $(( lines * 1000000 / elapsed )) lines/sec"
@@ -0,0 +1,33 @@
+#! /bin/bash
+
+# Compare child launch latency of wish's process creation backends.
+# usage: ./bench-spawn.sh [lines] [commands per line]
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+lines=${1:-2000}
+width=${2:-4}
+
+batch=$(mktemp)
+trap 'rm -f $batch' EXIT
+
+# each line fans out 'width' parallel commands joined by '&'
+cmd="true"
+for (( i = 1; i < width; i++ )); do
+    cmd="$cmd & true"
+done
+for (( i = 0; i < lines; i++ )); do
+    echo "$cmd"
+done > $batch
+
+total=$(( lines * width ))
+for backend in fork spawn; do
+    start=$(date +%s%N)
+    ./wish -p -s $backend $batch
+    end=$(date +%s%N)
+    elapsed=$(( end - start ))
+    echo "$backend: $total launches in $(( elapsed / 1000000 )) ms, $(( elapsed / total / 1000 )) us/launch"
+done
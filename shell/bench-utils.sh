@@ -0,0 +1,35 @@
+#! /bin/bash
+
+# Compare lines/sec of a tests/-style script of echo, true, test and small
+# cat lines, with the utilities run in-process and as processes (-p).
+# usage: ./bench-utils.sh [lines]
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+lines=${1:-4000}
+
+batch=$(mktemp)
+out=$(mktemp)
+trap 'rm -f $batch $out' EXIT
+
+for (( i = 0; i < lines / 4; i++ )); do
+    echo "echo line $i > $out"
+    echo "true"
+    echo "test -f $out"
+    echo "cat tests/1.desc $out > /dev/null & echo done > /dev/null"
+done > $batch
+
+for mode in in-process processes; do
+    flags=""
+    if [[ $mode == processes ]]; then
+        flags="-p"
+    fi
+    start=$(date +%s%N)
+    ./wish $flags $batch
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000 ))
+    echo "$mode: $lines lines in $(( elapsed / 1000 )) ms, $(( lines * 1000000 / elapsed )) lines/sec"
+done
@@ -0,0 +1,26 @@
+#! /bin/bash
+# Feed wish lines of missing commands and check their error messages are
+# all written, but by a handful of writev() calls rather than one each.
+lines=${1:-2000}
+
+batch=$(mktemp)
+errors=$(mktemp)
+trap 'rm -f $batch $errors' EXIT
+{
+    echo "path /bin tests"
+    yes "nosuchcmd" | head -n $lines
+    echo "syscw.sh"
+    echo "exit"
+} > $batch
+
+writes=$(./wish $batch 2> $errors)
+count=$(grep -c 'An error has occurred' $errors)
+if (( count != lines )); then
+    echo "$count of $lines errors written"
+    exit 1
+fi
+if (( writes > lines / 64 )); then
+    echo "$lines errors took $writes writes"
+    exit 1
+fi
+echo "errors batched"
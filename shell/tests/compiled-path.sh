@@ -0,0 +1,13 @@
+#! /bin/bash
+# Run tests/42.in with DIR replaced by a directory holding two versions of a
+# 'pick' command, in a/ and b/, interpreted and then compiled: both runs must
+# find the same one after each 'path'.
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+for v in a b; do
+    mkdir $dir/$v
+    printf '#! /bin/sh\necho %s\n' $v > $dir/$v/pick
+    chmod +x $dir/$v/pick
+done
+sed "s|DIR|$dir|g" tests/42.in > $dir/script
+./wish $dir/script && ./wish --compile $dir/script -o $dir/script.wshc && ./wish $dir/script.wshc
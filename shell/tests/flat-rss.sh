@@ -0,0 +1,26 @@
+#! /bin/bash
+# Feed wish 10M lines of builtins and check its heap RSS stays flat, i.e.
+# tokenizing a line leaks nothing and allocates nothing once warmed up.
+lines=${1:-10000000}
+line='cd   . & cd .|cd tests/..   > /dev/null &'
+
+batch=$(mktemp)
+trap 'rm -f $batch' EXIT
+{
+    echo "path /bin tests"
+    yes "$line" | head -n 1000
+    echo "rss.sh"
+    yes "$line" | head -n $lines
+    echo "rss.sh"
+    echo "exit"
+} > $batch
+
+./wish $batch | {
+    read before
+    read after
+    if (( after - before > 64 )); then
+        echo "RSS grew from $before kB to $after kB"
+        exit 1
+    fi
+    echo "RSS flat"
+}
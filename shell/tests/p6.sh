@@ -0,0 +1,4 @@
+#!/bin/bash
+sleep 2
+echo "#! /bin/sh"
+echo echo generated
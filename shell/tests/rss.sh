@@ -0,0 +1,5 @@
+#! /bin/bash
+# print the anonymous (heap) resident set size (kB) of the shell that started
+# us, pages of a mapped batch file are file backed and not counted
+grep RssAnon /proc/$PPID/status | tr -dc '0-9'
+echo
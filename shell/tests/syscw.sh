@@ -0,0 +1,5 @@
+#! /bin/bash
+# print how many write syscalls the shell that started us has made so far,
+# as counted by the kernel in /proc/PID/io
+grep syscw /proc/$PPID/io | tr -dc '0-9'
+echo
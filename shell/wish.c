@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ctype.h"
 #include "stdbool.h"
 #include "stdio.h"
@@ -5,17 +6,108 @@
 #include "string.h"
 #include "unistd.h"
 #include "sys/wait.h"
+#include "sys/resource.h"
+#include "sys/stat.h"
+#include "sys/sendfile.h"
+#include "sys/mman.h"
+#include "sys/socket.h"
+#include "sys/prctl.h"
+#include "sys/uio.h"
+#include "dirent.h"
+#include "sys/epoll.h"
+#include "sys/signalfd.h"
+#include "errno.h"
+#include "limits.h"
+#include "signal.h"
+#include "elf.h"
+#include "zygote.h"
 #include "fcntl.h"
+#include "time.h"
+#include "spawn.h"
+#include "stdint.h"
+#include "getopt.h"
+#include "termios.h"
+#include "sys/ioctl.h"
 
 char* PATH = "/bin";
 
+extern char **environ;
+
+// how children are created: posix_spawn lets libc use vfork/CLONE_VFORK so
+// the shell's page tables are never copied, fork is kept as a fallback
+enum SpawnBackend {
+    SPAWN_POSIX,
+    SPAWN_FORK
+};
+#ifdef _POSIX_SPAWN
+enum SpawnBackend spawn_backend = SPAWN_POSIX;
+#else
+enum SpawnBackend spawn_backend = SPAWN_FORK;
+#endif
+
+// exit statuses of each stage of the last pipeline run, like bash's PIPESTATUS
+#define STATUS_NOT_FOUND 127
+#define STATUS_NOT_EXECUTABLE 126
+int *pipestatus = NULL;
+int pipestatus_count = 0;
+int pipestatus_size = 0;
+int last_status = 0;    // $?, the status of the last stage of the last line
+
+// Diagnostics (error messages and the prompt) are queued and written to
+// stderr together by one writev() instead of a write() each. The queue is
+// flushed before anything else can write to stderr: before a child is
+// created or an in-process utility runs, before the shell waits for jobs or
+// input, before job and time reports, and at exit.
+#define DIAG_QUEUE 256
+struct iovec diag_queue[DIAG_QUEUE];
+int diag_count = 0;
+bool diag_buffered = true;  // false in forked children, which _exit()
+
+void diag_flush() {
+    int done = 0;
+    while (done < diag_count) {
+        ssize_t written = writev(STDERR_FILENO, &diag_queue[done], diag_count - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // skip what was written, which may end part way through a message
+        while (done < diag_count && written >= (ssize_t)diag_queue[done].iov_len) {
+            written -= diag_queue[done++].iov_len;
+        }
+        if (done < diag_count) {
+            diag_queue[done].iov_base = (char *)diag_queue[done].iov_base + written;
+            diag_queue[done].iov_len -= written;
+        }
+    }
+    diag_count = 0;
+}
+
+// queue msg, which must stay valid until the next flush
+void diag_write(const char *msg, size_t len) {
+    if (!diag_buffered) {
+        write(STDERR_FILENO, msg, len);
+        return;
+    }
+    if (diag_count == DIAG_QUEUE) {
+        diag_flush();
+    }
+    diag_queue[diag_count].iov_base = (void *)msg;
+    diag_queue[diag_count].iov_len = len;
+    diag_count++;
+}
+
+const char ps1[] = "wish> ";
+
 void print_ps1() {
-    fprintf(stderr, "wish> ");
+    diag_write(ps1, sizeof(ps1) - 1);
 }
 
 void print_error() {
-    char error_message[30] = "An error has occurred\n";
-    write(STDERR_FILENO, error_message, strlen(error_message));
+    static const char error_message[] = "An error has occurred\n";
+    diag_write(error_message, sizeof(error_message) - 1);
 }
 
 void validate_argv(int argc, char *argv[]) {
@@ -48,7 +140,302 @@ bool is_interactive_mode(int argc) {
     return false;
 }
 
-// built-ins: cd, exit, and path
+char* concat(const char *s1, const char *s2) {
+    char *result = malloc(strlen(s1) + strlen(s2) + 2);
+    if (result == NULL) {
+        print_error();
+        return "";
+    }
+    strcpy(result, s1);
+    strcat(result, "/");
+    strcat(result, s2);
+    return result;
+}
+
+char *find_command_in_path(char *cmd, char *PATH) {
+    char *path;
+    const char delim[2] = ":";
+
+    path = strtok(PATH, delim);
+    while (path != NULL) {
+        // test if command exists at directory from $PATH
+        char* exe = concat(path, cmd);
+        int result = access(exe, F_OK);
+        if (result == 0) {
+            return exe;
+        }
+        free(exe);
+
+        // move on to the next path in $PATH
+        path = strtok(NULL, delim);
+    }
+    return "";
+}
+
+// Command hash table: maps a command name to the absolute path it resolved
+// to, so repeated commands skip the PATH walk (and its access() calls).
+// The table is cleared whenever PATH changes. With mtime checking enabled a
+// hit is also discarded if the directory it was found in has changed since.
+#define HASH_BUCKETS 64
+
+struct HashEntry {
+    char *cmd;
+    char *exe;
+    struct timespec dir_mtime;
+    int hits;
+    struct HashEntry *next;
+};
+
+struct HashEntry *cmd_hash[HASH_BUCKETS];
+unsigned long hash_hits = 0;
+unsigned long hash_misses = 0;
+bool hash_check_mtime = false;
+
+unsigned int fnv1a_n(const char *str, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned int fnv1a(const char *str) {
+    return fnv1a_n(str, strlen(str));
+}
+
+unsigned int hash_string(const char *str) {
+    return fnv1a(str) % HASH_BUCKETS;
+}
+
+// stat the directory part of exe, returning false if it can't be read
+bool dir_mtime_of(char *exe, struct timespec *mtime) {
+    struct stat st;
+    char *slash = strrchr(exe, '/');
+    if (slash == NULL) {
+        return false;
+    }
+    *slash = '\0';
+    int result = stat(slash == exe ? "/" : exe, &st);
+    *slash = '/';
+    if (result != 0) {
+        return false;
+    }
+    *mtime = st.st_mtim;
+    return true;
+}
+
+void hash_free_entry(struct HashEntry *entry) {
+    free(entry->cmd);
+    free(entry->exe);
+    free(entry);
+}
+
+void hash_clear() {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        struct HashEntry *entry = cmd_hash[i];
+        while (entry != NULL) {
+            struct HashEntry *temp = entry->next;
+            hash_free_entry(entry);
+            entry = temp;
+        }
+        cmd_hash[i] = NULL;
+    }
+}
+
+// Resolve cmd against PATH, consulting the hash table first. The returned
+// string is owned by the table; "" means the command was not found.
+char *hash_lookup(char *cmd) {
+    unsigned int bucket = hash_string(cmd);
+    struct HashEntry **link = &cmd_hash[bucket];
+    while (*link != NULL) {
+        struct HashEntry *entry = *link;
+        if (strcmp(entry->cmd, cmd) == 0) {
+            struct timespec mtime;
+            if (!hash_check_mtime
+                || (dir_mtime_of(entry->exe, &mtime)
+                    && mtime.tv_sec == entry->dir_mtime.tv_sec
+                    && mtime.tv_nsec == entry->dir_mtime.tv_nsec)) {
+                entry->hits++;
+                hash_hits++;
+                return entry->exe;
+            }
+            // directory changed since we cached it, drop the entry
+            *link = entry->next;
+            hash_free_entry(entry);
+            break;
+        }
+        link = &entry->next;
+    }
+
+    hash_misses++;
+    char *path = strdup(PATH);
+    if (path == NULL) {
+        print_error();
+        return "";
+    }
+    char *exe = find_command_in_path(cmd, path);
+    free(path);
+    if (strlen(exe) == 0) {
+        return exe;
+    }
+
+    struct HashEntry *entry = malloc(sizeof(struct HashEntry));
+    if (entry == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    entry->cmd = strdup(cmd);
+    entry->exe = exe;
+    entry->hits = 1;
+    if (!dir_mtime_of(exe, &entry->dir_mtime)) {
+        entry->dir_mtime.tv_sec = 0;
+        entry->dir_mtime.tv_nsec = 0;
+    }
+    entry->next = cmd_hash[bucket];
+    cmd_hash[bucket] = entry;
+    return exe;
+}
+
+// Shell variables: NAME=value lines set them, $NAME and ${NAME} expand to
+// them and export marks them for the environment of commands. The
+// environment starts out as the shell's own, every variable in it exported.
+// Each variable keeps its "NAME=value" string, so the envp of children is an
+// array of pointers to those. It is shared by every launch and only replaced
+// (copy on write) by the first launch after an exported variable changed.
+#define VAR_BUCKETS 64
+
+struct Variable {
+    char *entry;            // "NAME=value"
+    size_t name_len;
+    bool exported;
+    struct Variable *next;
+};
+
+struct Variable *variables[VAR_BUCKETS];
+int num_exported = 0;
+char **child_envp = NULL;
+bool envp_stale = true;
+unsigned long env_generation = 0;   // counts changes to the environment
+
+unsigned int var_bucket(const char *name, size_t len) {
+    return fnv1a_n(name, len) % VAR_BUCKETS;
+}
+
+struct Variable *find_variable(const char *name, size_t len) {
+    struct Variable *var = variables[var_bucket(name, len)];
+    for (; var != NULL; var = var->next) {
+        if (var->name_len == len && strncmp(var->entry, name, len) == 0) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+// value of the variable named by the len bytes at name, or NULL if unset
+char *get_variable(const char *name, size_t len) {
+    struct Variable *var = find_variable(name, len);
+    return var ? var->entry + len + 1 : NULL;
+}
+
+// set from a "NAME=value" string (or just "NAME" to keep the current value),
+// exporting the variable if export is set
+void set_variable(const char *entry, bool export) {
+    size_t len = strcspn(entry, "=");
+    struct Variable *var = find_variable(entry, len);
+    if (var == NULL) {
+        var = calloc(1, sizeof(struct Variable));
+        if (var == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        unsigned int bucket = var_bucket(entry, len);
+        var->name_len = len;
+        var->next = variables[bucket];
+        variables[bucket] = var;
+    }
+    if (entry[len] == '=' || var->entry == NULL) {
+        char *copy = malloc(len + strlen(entry + len) + 2);
+        if (copy == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, entry, len);
+        strcpy(copy + len, entry[len] == '=' ? entry + len : "=");
+        free(var->entry);
+        var->entry = copy;
+        if (var->exported) {
+            envp_stale = true;
+        }
+    }
+    if (export && !var->exported) {
+        var->exported = true;
+        num_exported++;
+        envp_stale = true;
+    }
+    if (envp_stale) {
+        env_generation++;
+    }
+}
+
+void init_variables() {
+    for (int i = 0; environ[i] != NULL; i++) {
+        if (strchr(environ[i], '=') != NULL) {
+            set_variable(environ[i], true);
+        }
+    }
+}
+
+// the environment for children, rebuilt only after an exported change
+char **child_environ() {
+    if (envp_stale) {
+        // launches keep using the old array until this one replaces it
+        char **envp = malloc((num_exported + 1) * sizeof(char*));
+        if (envp == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        int n = 0;
+        for (int i = 0; i < VAR_BUCKETS; i++) {
+            for (struct Variable *var = variables[i]; var != NULL; var = var->next) {
+                if (var->exported) {
+                    envp[n++] = var->entry;
+                }
+            }
+        }
+        envp[n] = NULL;
+        free(child_envp);
+        child_envp = envp;
+        envp_stale = false;
+    }
+    return child_envp;
+}
+
+// length of the variable name at the start of str
+size_t name_length(const char *str) {
+    size_t len = 0;
+    if (isalpha((unsigned char)str[0]) || str[0] == '_') {
+        while (isalnum((unsigned char)str[len]) || str[len] == '_') {
+            len++;
+        }
+    }
+    return len;
+}
+
+bool is_assignment(const char *word) {
+    size_t len = name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+// defined with the job table they wait on
+void wait_all_jobs();
+void wait_foreground_jobs();
+int wish_jobs(int argc, char *args[]);
+
+// defined with the line editor
+void editor_hide();
+
+// built-ins: cd, exit, path, hash, pipestatus, wait, jobs, export, and bench
 int wish_cd(int argc, char *args[]) {
     // check exactly 1 arg is passed to cd
     if (argc != 2) {
@@ -68,6 +455,8 @@ int wish_exit(int argc, char *args[]) {
         print_error();
         return EXIT_FAILURE;
     }
+    // background jobs still get to finish
+    wait_all_jobs();
     exit(0);
 }
 
@@ -79,11 +468,12 @@ int wish_path(int argc, char *args[]) {
     }
 
     // allocate space
-    char *path = malloc(total_length);
+    char *path = malloc(total_length + 1);
     if (path == NULL) {
         print_error();
         return -1;
     }
+    path[0] = '\0';
 
     // copy in ':' delimited string of directories
     for (int i = 1; i < argc; i++) {
@@ -98,13 +488,103 @@ int wish_path(int argc, char *args[]) {
     }
 
     PATH = path;
+
+    // cached locations may no longer be reachable through the new path
+    hash_clear();
     return 0;
 }
 
+int wish_hash(int argc, char *args[]) {
+    // 'hash -r' forgets all remembered locations, 'hash -m' turns on
+    // revalidation of entries against their directory's mtime
+    if (argc == 2 && strcmp(args[1], "-r") == 0) {
+        hash_clear();
+        hash_hits = 0;
+        hash_misses = 0;
+        return EXIT_SUCCESS;
+    }
+    if (argc == 2 && strcmp(args[1], "-m") == 0) {
+        hash_check_mtime = true;
+        return EXIT_SUCCESS;
+    }
+    if (argc != 1) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+
+    printf("hits\tcommand\n");
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (struct HashEntry *entry = cmd_hash[i]; entry != NULL; entry = entry->next) {
+            printf("%4d\t%s\n", entry->hits, entry->exe);
+        }
+    }
+    printf("hash: %lu hits, %lu misses\n", hash_hits, hash_misses);
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+int wish_pipestatus(int argc, char *args[]) {
+    // check exactly no args are passed to pipestatus
+    if (argc != 1) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < pipestatus_count; i++) {
+        printf(i > 0 ? " %d" : "%d", pipestatus[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+int wish_wait(int argc, char *args[]) {
+    // check exactly no args are passed to wait
+    if (argc != 1) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+    // builtins already run once the foreground jobs are done, this also
+    // waits for the background ones
+    wait_all_jobs();
+    return EXIT_SUCCESS;
+}
+
+int wish_export(int argc, char *args[]) {
+    // 'export' lists the environment, 'export NAME[=value] ...' adds to it
+    if (argc == 1) {
+        char **envp = child_environ();
+        for (int i = 0; envp[i] != NULL; i++) {
+            printf("export %s\n", envp[i]);
+        }
+        fflush(stdout);
+        return EXIT_SUCCESS;
+    }
+    int status = EXIT_SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        size_t len = name_length(args[i]);
+        if (len == 0 || (args[i][len] != '\0' && args[i][len] != '=')) {
+            print_error();
+            status = EXIT_FAILURE;
+            continue;
+        }
+        set_variable(args[i], true);
+    }
+    return status;
+}
+
+// defined with the executor it drives
+int wish_bench(int argc, char *args[]);
+
 char *builtin_options[] = {
   "cd",
   "exit",
-  "path"
+  "path",
+  "hash",
+  "pipestatus",
+  "wait",
+  "jobs",
+  "export",
+  "bench"
 };
 
 int num_of_builtins() {
@@ -115,208 +595,795 @@ int (*builtin_func[]) (int argc, char **) = {
   &wish_cd,
   &wish_exit,
   &wish_path,
+  &wish_hash,
+  &wish_pipestatus,
+  &wish_wait,
+  &wish_jobs,
+  &wish_export,
+  &wish_bench,
 };
 
-char* wish_read_line(FILE *input) {
-    char *line = NULL;
-    size_t buffsize = 0;
-    if (getline(&line, &buffsize, input) == -1) {
-        if (feof(input)) {
-           if (input != stdin) {
-                fclose(input); 
-            }
-            exit(EXIT_SUCCESS);
+// Where lines come from: regular batch files are mapped and lines are
+// handed to the tokenizer as slices of the mapping, anything else (stdin,
+// pipes, or -r stdio) is read with getline() through stdio.
+enum InputReader {
+    READ_MMAP,
+    READ_STDIO
+};
+enum InputReader input_reader = READ_MMAP;
+
+struct InputSource {
+    FILE *stream;
+    char *map;
+    size_t map_size;
+    size_t offset;      // start of the next line in map
+    size_t released;    // bytes at the start of map already given back
+};
+
+// consumed parts of the mapping are dropped in steps of this many bytes so
+// a multi-GB script doesn't stay resident
+#define MAP_RELEASE_WINDOW (4 << 20)
+
+struct InputSource open_input(char *filename) {
+    struct InputSource input = {0};
+    if (filename == NULL) {
+        input.stream = stdin;
+        return input;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && input_reader == READ_MMAP && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        input.map_size = st.st_size;
+        if (input.map_size == 0) {
+            close(fd);
+            return input;
+        }
+        input.map = mmap(NULL, input.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input.map != MAP_FAILED) {
+            // hints only, failures are harmless
+            madvise(input.map, input.map_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(input.map, input.map_size, MADV_HUGEPAGE);
+#endif
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            close(fd);
+            return input;
+        }
+        input.map = NULL;
+        input.map_size = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    input.stream = open_stream(filename, "re");
+    return input;
+}
+
+void close_input(struct InputSource *input) {
+    if (input->map != NULL) {
+        munmap(input->map, input->map_size);
+        input->map = NULL;
+    }
+    if (input->stream != NULL && input->stream != stdin) {
+        fclose(input->stream);
+    }
+}
+
+// The line buffer is reused for every line, getline() only grows it
+char *line_buffer = NULL;
+size_t line_buffsize = 0;
+
+// Return the next line (without requiring a NUL terminator) and its length
+// in *len, or NULL at the end of input.
+char* wish_read_line(struct InputSource *input, size_t *len) {
+    if (input->stream == NULL) {
+        if (input->offset >= input->map_size) {
+            return NULL;
+        }
+
+        // the previous line has been tokenized, so the pages before it
+        // won't be looked at again
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t consumed = input->offset & ~(page - 1);
+        if (consumed - input->released >= MAP_RELEASE_WINDOW) {
+            madvise(input->map + input->released, consumed - input->released, MADV_DONTNEED);
+            input->released = consumed;
+        }
+
+        char *line = input->map + input->offset;
+        char *newline = memchr(line, '\n', input->map_size - input->offset);
+        *len = newline ? (size_t)(newline - line) : input->map_size - input->offset;
+        input->offset += *len + (newline ? 1 : 0);
+        return line;
+    }
+
+    ssize_t read = getline(&line_buffer, &line_buffsize, input->stream);
+    if (read == -1) {
+        if (feof(input->stream)) {
+            return NULL;
         } else {
             print_error();
             exit(EXIT_FAILURE);
         }
     }
-    return line;
+    *len = read;
+    return line_buffer;
 }
 
-// https://stackoverflow.com/questions/122616/how-do-i-trim-leading-trailing-whitespace-in-a-standard-way
-char *trimwhitespace(char *str) {
-    char *end;
+// Per-line arena: commands and their args are bump allocated from a list of
+// chunks which is rewound (not freed) before each line, so once the chunks
+// are big enough for the longest line, parsing a line never calls malloc.
+#define ARENA_CHUNK 4096
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
 
-    // Trim leading space
-    while(isspace((unsigned char)*str)) str++;
+struct Arena {
+    struct ArenaChunk *head;
+    struct ArenaChunk *curr;
+};
+
+struct Arena line_arena;
 
-    if(*str == 0)  // All spaces?
-      return str;
+void *arena_alloc(struct Arena *arena, size_t size) {
+    // keep every allocation pointer aligned
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    struct ArenaChunk *chunk = arena->curr;
+    while (chunk != NULL && chunk->used + size > chunk->size) {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = NULL;
 
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
+        // append so the chunks skipped above are reused after a reset
+        if (arena->head == NULL) {
+            arena->head = chunk;
+        } else {
+            struct ArenaChunk *last = arena->curr;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = chunk;
+        }
+    }
+    arena->curr = chunk;
 
-    // Write new null terminator character
-    end[1] = '\0';
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
 
-    return str;
+void arena_reset(struct Arena *arena) {
+    for (struct ArenaChunk *chunk = arena->head; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->curr = arena->head;
 }
 
+// Redirect plan of a command, worked out by the tokenizer so the child
+// only has to open each file once and dup it into place:
+//   < file         stdin
+//   > file         stdout and stderr (truncate)
+//   >> file        stdout and stderr (append)
+//   &> file        same as '>'
+//   2> file        stderr
+#define MAX_REDIRECTS 3
+#define REDIRECT_STDIN  (1 << STDIN_FILENO)
+#define REDIRECT_STDOUT (1 << STDOUT_FILENO)
+#define REDIRECT_STDERR (1 << STDERR_FILENO)
+
+struct Redirect {
+    int fds;        // REDIRECT_* mask of descriptors the file replaces
+    int flags;      // open(2) flags
+    char *file;
+};
+
+// The pipelines of a line are joined by '&' (run together), or by ';', '&&'
+// and '||', which wait for the pipelines before them and, for '&&' and '||',
+// run the rest only if they succeeded or failed.
+enum Connector {
+    CONNECT_PARALLEL,
+    CONNECT_SEQUENCE,
+    CONNECT_AND,
+    CONNECT_OR,
+};
 
 struct Command {
     char *cmd;
     int argc;
     char **args;
-    char *outfile;
-    struct Command *next;
+    struct Redirect redirects[MAX_REDIRECTS];
+    int nredirects;
+    bool timed;            // pipeline was prefixed with 'time'
+    bool background;       // line ended with '&', nothing waits for it
+    char *exe;             // path resolved when compiled, or NULL
+    enum Connector connector;   // how the next pipeline follows this one
+    struct Command *pipe;  // next stage of a pipeline
+    struct Command *next;  // next pipeline of the line
 };
 
 #define BUFSIZE 64
-#define ARG_DELIM " \t\r"
-
-struct Command* create_command_from_string(char *trimmed_string) {
-    // do not allow more than one '>'
-    bool found_redirect = false;
-    for(int i = 0; i < strlen(trimmed_string); i++) {
-        if (trimmed_string[i] == '>') {
-            if (found_redirect) {
-                print_error();
-                return NULL;
-            }
-            found_redirect = true;
-        }
-    }
 
-    // Split line into args and output file name
-    //=======================================================
-    char *outfile = NULL;
-    int matches = 0;
-    char *token = strtok(trimmed_string, ">");
-    while (token != NULL) {
-        // first token is args
-        if (matches == 0) {
-            trimmed_string  = token;
-        } else {
-            outfile = token;
-        }
+// Args of the stage being tokenized are collected here before being copied
+// into the arena, the vector is kept (and only ever grown) across lines
+char **stage_args = NULL;
+int stage_args_size = 0;
 
-        // second token is output file descriptor
-        token = strtok(NULL, " >\t\r");
-        matches += 1;
-    }
-    if (matches > 2) {
-        print_error();
-        return NULL;
-    }
-    if (found_redirect && outfile == NULL) {
-        print_error();
-        return NULL;
+void push_stage_arg(int position, char *arg) {
+    if (position >= stage_args_size) {
+        stage_args_size += BUFSIZE;
+        stage_args = realloc(stage_args, stage_args_size * sizeof(char*));
+        if (!stage_args) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
     }
+    stage_args[position] = arg;
+}
 
-    // Split args into tokens
-    //=======================================================
+bool is_word_delim(char c) {
+    return c == '\0' || c == '&' || c == '|' || c == ';' || c == '>' || c == '<'
+           || isspace((unsigned char)c);
+}
 
-    // Allocate buffer for args
-    int bufsize = BUFSIZE, position = 0;
-    char **args = malloc(bufsize * sizeof(char*));
-    if (args == NULL) {
-        print_error();
-        exit(EXIT_FAILURE);
-    }
+// State of the stage and pipeline being tokenized
+struct TokenizerState {
+    int argc;            // words before the first redirect
+    struct Redirect redirects[MAX_REDIRECTS];
+    int nredirects;
+    int redirected;      // REDIRECT_* mask of descriptors already redirected
+    bool want_file;      // the last token was a redirect operator
+    bool stage_error;    // the stage's redirects are malformed
+    bool pipe_error;     // some stage of the pipeline was malformed
+    struct Command *pipe_head;
+    struct Command *pipe_tail;
+};
 
-    token = strtok(trimmed_string, ARG_DELIM);
-    while (token != NULL) {
-        args[position] = token;
-        position++;
+// Close the current stage, returning false if it is malformed
+bool finish_stage(struct TokenizerState *state, bool in_pipe) {
+    int argc = state->argc;
+    int nredirects = state->nredirects;
+    bool malformed = state->stage_error || state->want_file;
+    state->argc = 0;
+    state->nredirects = 0;
+    state->redirected = 0;
+    state->want_file = false;
+    state->stage_error = false;
 
-        if (position >= bufsize) {
-            bufsize += BUFSIZE;
-            args = realloc(args, bufsize * sizeof(char*));
-            if (!args) {
-                print_error();
-                exit(EXIT_FAILURE);
-            }
-        }
-        token = strtok(NULL, ARG_DELIM);
+    if (argc == 0 && nredirects == 0 && !in_pipe) {
+        // nothing at all, e.g. an empty command between '&'s
+        return true;
+    }
+    if (argc == 0 || malformed) {
+        return false;
     }
-    args[position] = NULL;
 
+    // 'time cmd ...' at the start of a pipeline reports its resource usage
+    char **words = stage_args;
+    bool timed = false;
+    if (state->pipe_head == NULL && argc > 1 && strcmp(words[0], "time") == 0) {
+        timed = true;
+        words++;
+        argc--;
+    }
 
     // Create command object
-    struct Command *node = (struct Command*)malloc(sizeof(struct Command)); 
-    if (node == NULL) {
-        print_error();
-        exit(EXIT_FAILURE);
-    }
+    struct Command *node = arena_alloc(&line_arena, sizeof(struct Command));
+    char **args = arena_alloc(&line_arena, (argc + 1) * sizeof(char*));
+    memcpy(args, words, argc * sizeof(char*));
+    args[argc] = NULL;
     node->cmd = args[0];
-    node->next = NULL;
+    node->argc = argc;
     node->args = args;
-    node->argc = position;
-    node->outfile = outfile;
-    return node;
-}
-
-struct Command* wish_tokenize_line(char *line) {
-    // Extract all commands from line into array of tokens
-    int bufsize = BUFSIZE, position = 0;
-    char **cmds = malloc(BUFSIZE * sizeof(char*));
-    char *token = strtok(line, "&");
-    while (token != NULL) {
-        cmds[position++] = token;
-        token = strtok (NULL, "&");
-
-        if (position >= BUFSIZE) {
-            bufsize += BUFSIZE;
-            cmds = realloc(cmds, bufsize * sizeof(char*));
-            if (!cmds) {
-                print_error();
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
+    memcpy(node->redirects, state->redirects, nredirects * sizeof(struct Redirect));
+    node->nredirects = nredirects;
+    node->timed = timed;
+    node->background = false;
+    node->exe = NULL;
+    node->connector = CONNECT_PARALLEL;
+    node->pipe = NULL;
+    node->next = NULL;
 
-    // loop through each string to create commands
+    if (state->pipe_head == NULL) {
+        state->pipe_head = node;
+    } else {
+        state->pipe_tail->pipe = node;
+    }
+    state->pipe_tail = node;
+    return true;
+}
+
+// Add a redirect operator to the stage, its file is the next word
+void add_redirect(struct TokenizerState *state, int fds, int flags) {
+    // each descriptor can only be redirected once, and the operator needs
+    // exactly one file before the next operator
+    if (state->want_file || (state->redirected & fds) || state->nredirects == MAX_REDIRECTS) {
+        state->stage_error = true;
+        return;
+    }
+    struct Redirect *redirect = &state->redirects[state->nredirects++];
+    redirect->fds = fds;
+    redirect->flags = flags;
+    redirect->file = NULL;
+    state->redirected |= fds;
+    state->want_file = true;
+}
+
+// malformed pipelines in the last line tokenized, each reported with an error
+int parse_errors = 0;
+
+// Split a line into pipelines of '|' separated commands, each with args and
+// optional redirects, joined by '&', ';', '&&' or '||'. This is a single pass over a
+// read-only slice of len bytes (which may point into the mapped batch file);
+// words are copied out NUL terminated and all nodes come from line_arena.
+struct Command* wish_tokenize_line(const char *line, size_t len) {
     struct Command *head = NULL;
     struct Command *curr_node = NULL;
-    for (int i = 0; i < position; i++) {
-        char *trimmed_token = trimwhitespace(cmds[i]);
-        if (strcmp(trimmed_token, "") != 0) {
-            // Create command and add to linked list
-            struct Command *node = create_command_from_string(trimmed_token);
-            if (head == NULL) {
-                head = node;
-                curr_node = head;
+    struct Command *last_group = NULL;  // first pipeline after the last ';', '&&' or '||'
+    struct TokenizerState state = {0};
+    enum Connector connector = CONNECT_PARALLEL;    // before the next pipeline
+    bool bad_connector = false;
+    bool in_pipe = false;
+    bool background = false;    // nothing but '&'s and spaces since the last '&'
+    parse_errors = 0;
+
+    const char *p = line;
+    const char *end = line + len;
+    while (true) {
+        // an embedded NUL ends the line, as it did with getline()/strtok()
+        char c = p < end ? *p : '\0';
+        char next = p + 1 < end ? p[1] : '\0';
+        if (!isspace((unsigned char)c) && c != '\0') {
+            background = c == '&' && next != '>' && next != '&';
+        }
+        if (isspace((unsigned char)c)) {
+            p++;
+        } else if (c == '<') {
+            add_redirect(&state, REDIRECT_STDIN, O_RDONLY);
+            p++;
+        } else if (c == '>' && next == '>') {
+            add_redirect(&state, REDIRECT_STDOUT | REDIRECT_STDERR,
+                         O_WRONLY | O_CREAT | O_APPEND);
+            p += 2;
+        } else if (c == '>' || (c == '&' && next == '>')) {
+            add_redirect(&state, REDIRECT_STDOUT | REDIRECT_STDERR,
+                         O_WRONLY | O_CREAT | O_TRUNC);
+            p += c == '&' ? 2 : 1;
+        } else if (c == '|' || c == '&' || c == ';' || c == '\0') {
+            // '&&' and '||' are single operators, not an empty command or stage
+            bool is_pipe = c == '|' && next != '|';
+            enum Connector op = c == ';' ? CONNECT_SEQUENCE
+                                : c == '&' && next == '&' ? CONNECT_AND
+                                : c == '|' && next == '|' ? CONNECT_OR
+                                : CONNECT_PARALLEL;
+            if (!finish_stage(&state, in_pipe || is_pipe)) {
+                state.pipe_error = true;
+            }
+            in_pipe = is_pipe;
+
+            if (!in_pipe) {
+                // end of pipeline, add it to the list of commands
+                if (state.pipe_error) {
+                    print_error();
+                    parse_errors++;
+                    connector = op;
+                } else if (state.pipe_head != NULL) {
+                    if (head == NULL) {
+                        head = state.pipe_head;
+                    } else {
+                        curr_node->connector = connector;
+                        curr_node->next = state.pipe_head;
+                    }
+                    if (head == state.pipe_head || connector != CONNECT_PARALLEL) {
+                        last_group = state.pipe_head;
+                    }
+                    curr_node = state.pipe_head;
+                    connector = op;
+                } else if (connector == CONNECT_AND || connector == CONNECT_OR
+                           || op == CONNECT_AND || op == CONNECT_OR) {
+                    // '&&' and '||' need a pipeline on both sides
+                    bad_connector = true;
+                    connector = op;
+                } else if (op == CONNECT_SEQUENCE) {
+                    // empty commands between separators, a ';' wins over '&'
+                    connector = CONNECT_SEQUENCE;
+                }
+                state.pipe_error = false;
+                state.pipe_head = NULL;
+                state.pipe_tail = NULL;
+            }
+            if (c == '\0') {
+                break;
+            }
+            p += op == CONNECT_AND || op == CONNECT_OR ? 2 : 1;
+        } else {
+            // a word, copy it into the arena as a string
+            const char *start = p;
+            while (p < end && !is_word_delim(*p)) {
+                p++;
+            }
+            if (p - start == 1 && *start == '2' && p < end && *p == '>') {
+                // '2>' operator
+                add_redirect(&state, REDIRECT_STDERR, O_WRONLY | O_CREAT | O_TRUNC);
+                p++;
+                continue;
+            }
+            char *word = arena_alloc(&line_arena, p - start + 1);
+            memcpy(word, start, p - start);
+            word[p - start] = '\0';
+
+            if (state.want_file) {
+                state.redirects[state.nredirects - 1].file = word;
+                state.want_file = false;
+            } else if (state.nredirects == 0) {
+                push_stage_arg(state.argc++, word);
             } else {
-                curr_node->next = node;
-                curr_node = node;
+                // words after a redirect, e.g. multiple files after '>'
+                state.stage_error = true;
             }
         }
     }
+
+    if (bad_connector) {
+        // a condition is missing, so no part of the line is safe to run
+        print_error();
+        parse_errors++;
+        return NULL;
+    }
+
+    // a trailing '&' runs the pipelines after the last ';', '&&' or '||' in
+    // the background
+    for (struct Command *pipeline = last_group; background && pipeline != NULL;
+         pipeline = pipeline->next) {
+        pipeline->background = true;
+    }
     return head;
 }
 
-char* concat(const char *s1, const char *s2) {
-    char *result = malloc(strlen(s1) + strlen(s2) + 2);
-    if (result == NULL) {
-        print_error();
-        return "";
+// Expand $NAME and ${NAME} in word into out (if not NULL), returning the
+// length of the result. Unset variables expand to nothing, a '$' that
+// doesn't start a name is kept.
+size_t expand_into(const char *word, char *out) {
+    size_t len = 0;
+    const char *p = word;
+    while (*p) {
+        if (p[0] == '$' && p[1] == '?') {
+            // the jobs it's the status of have to be done first
+            wait_foreground_jobs();
+            char status[16];
+            size_t status_len = snprintf(status, sizeof(status), "%d", last_status);
+            if (out) {
+                memcpy(out + len, status, status_len);
+            }
+            len += status_len;
+            p += 2;
+            continue;
+        }
+        if (*p == '$') {
+            const char *name = p + 1;
+            bool braced = *name == '{';
+            name += braced;
+            size_t name_len = name_length(name);
+            if (name_len > 0 && (!braced || name[name_len] == '}')) {
+                char *value = get_variable(name, name_len);
+                size_t value_len = value ? strlen(value) : 0;
+                if (out) {
+                    memcpy(out + len, value, value_len);
+                }
+                len += value_len;
+                p = name + name_len + braced;
+                continue;
+            }
+        }
+        if (out) {
+            out[len] = *p;
+        }
+        len++;
+        p++;
     }
-    strcpy(result, s1);
-    strcat(result, "/");
-    strcat(result, s2);
-    return result;
+    return len;
 }
 
-char *find_command_in_path(char *cmd, char *PATH) {
+char *expand_word(char *word) {
+    if (strchr(word, '$') == NULL) {
+        return word;
+    }
+    size_t len = expand_into(word, NULL);
+    char *expanded = arena_alloc(&line_arena, len + 1);
+    expand_into(word, expanded);
+    expanded[len] = '\0';
+    return expanded;
+}
+
+// Globs: after variables are expanded, words with *, ? or [...] are
+// replaced by the sorted paths they match (or kept as they are when nothing
+// matches). Directories are read once per line, however many globs on the
+// line look at them: the cache is kept in line_arena.
+struct DirCache {
     char *path;
-    const char delim[2] = ":";
+    char **names;       // sorted, without . and ..
+    int count;
+    struct DirCache *next;
+};
 
-    path = strtok(PATH, delim);
-    while (path != NULL) {
-        // test if command exists at directory from $PATH
-        char* exe = concat(path, cmd);
-        int result = access(exe, F_OK);
-        if (result == 0) {
-            return exe;
+struct DirCache *dir_cache = NULL;
+
+// directory entries are collected here before being copied to the arena
+char **dir_names = NULL;
+int dir_names_size = 0;
+
+// matches of the word being expanded, kept across lines
+char **glob_matches = NULL;
+int glob_count = 0;
+int glob_size = 0;
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+char *arena_concat(const char *s1, size_t len1, const char *s2, size_t len2) {
+    char *result = arena_alloc(&line_arena, len1 + len2 + 1);
+    memcpy(result, s1, len1);
+    memcpy(result + len1, s2, len2);
+    result[len1 + len2] = '\0';
+    return result;
+}
+
+// the sorted entries of path ("" for the current directory)
+struct DirCache *read_dir_cached(char *path) {
+    for (struct DirCache *dir = dir_cache; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) {
+            return dir;
         }
-        free(exe);
+    }
+    struct DirCache *dir = arena_alloc(&line_arena, sizeof(struct DirCache));
+    dir->path = path;
+    dir->count = 0;
+    DIR *stream = opendir(*path ? path : ".");
+    struct dirent *entry;
+    while (stream != NULL && (entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (dir->count == dir_names_size) {
+            dir_names_size = dir_names_size ? 2 * dir_names_size : 64;
+            dir_names = realloc(dir_names, dir_names_size * sizeof(char*));
+            if (dir_names == NULL) {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+        }
+        dir_names[dir->count++] = arena_concat(entry->d_name, strlen(entry->d_name), "", 0);
+    }
+    if (stream != NULL) {
+        closedir(stream);
+    }
+    qsort(dir_names, dir->count, sizeof(char*), compare_strings);
+    dir->names = arena_alloc(&line_arena, dir->count * sizeof(char*));
+    memcpy(dir->names, dir_names, dir->count * sizeof(char*));
+    dir->next = dir_cache;
+    dir_cache = dir;
+    return dir;
+}
 
-        // move on to the next path in $PATH
-        path = strtok(NULL, delim);
+// If c matches the single pattern element (a char, ? or [...]) at the
+// start of pattern, return the pattern after that element, else NULL.
+const char *match_element(const char *pattern, char c) {
+    if (*pattern == '\0') {
+        return NULL;
+    }
+    if (*pattern == '?') {
+        return pattern + 1;
+    }
+    if (*pattern == '[') {
+        const char *p = pattern + 1;
+        bool negate = *p == '!' || *p == '^';
+        p += negate;
+        // a ']' right after the '[' (or '[!') is part of the set
+        const char *end = strchr(*p == ']' ? p + 1 : p, ']');
+        if (end != NULL) {
+            bool found = false;
+            for (; p < end; p++) {
+                if (p + 2 < end && p[1] == '-') {
+                    found |= (unsigned char)c >= (unsigned char)p[0]
+                             && (unsigned char)c <= (unsigned char)p[2];
+                    p += 2;
+                } else {
+                    found |= c == *p;
+                }
+            }
+            return found != negate ? end + 1 : NULL;
+        }
+        // no closing ']', an ordinary '['
+    }
+    return *pattern == c ? pattern + 1 : NULL;
+}
+
+// Match name against a pattern for one path component. Only the position
+// after the last '*' is remembered, and a mismatch resumes from there one
+// char further on: patterns like a*a*a*a*b take O(pattern * name) steps
+// instead of backtracking through every way of splitting the name.
+bool glob_match(const char *pattern, const char *name) {
+    if (name[0] == '.' && pattern[0] != '.') {
+        // hidden files have to be asked for
+        return false;
+    }
+    const char *star = NULL;
+    const char *resume = NULL;
+    while (*name) {
+        const char *next;
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = name;
+        } else if ((next = match_element(pattern, *name)) != NULL) {
+            pattern = next;
+            name++;
+        } else if (star != NULL) {
+            pattern = star;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+bool has_glob(const char *word, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (word[i] == '*' || word[i] == '?'
+            || (word[i] == '[' && memchr(word + i, ']', len - i) != NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void add_glob_match(char *path) {
+    if (glob_count == glob_size) {
+        glob_size = glob_size ? 2 * glob_size : 64;
+        glob_matches = realloc(glob_matches, glob_size * sizeof(char*));
+        if (glob_matches == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+    glob_matches[glob_count++] = path;
+}
+
+// add the paths under base (empty, or ending in '/') matching pattern
+void glob_dir(char *base, const char *pattern) {
+    const char *slash = strchr(pattern, '/');
+    size_t len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    size_t base_len = strlen(base);
+
+    if (!has_glob(pattern, len)) {
+        // a plain component (or the empty one before a leading '/')
+        char *path = arena_concat(base, base_len, pattern, slash ? len + 1 : len);
+        struct stat st;
+        if (slash != NULL) {
+            glob_dir(path, slash + 1);
+        } else if (lstat(path, &st) == 0) {
+            add_glob_match(path);
+        }
+        return;
+    }
+
+    char *component = arena_concat(pattern, len, "", 0);
+    struct DirCache *dir = read_dir_cached(base);
+    for (int i = 0; i < dir->count; i++) {
+        if (!glob_match(component, dir->names[i])) {
+            continue;
+        }
+        char *path = arena_concat(base, base_len, dir->names[i], strlen(dir->names[i]));
+        if (slash != NULL) {
+            glob_dir(arena_concat(path, strlen(path), "/", 1), slash + 1);
+        } else {
+            add_glob_match(path);
+        }
+    }
+}
+
+// find the sorted matches of word in glob_matches, returning how many
+int glob_word(char *word) {
+    glob_count = 0;
+    if (has_glob(word, strlen(word))) {
+        glob_dir("", word);
+        qsort(glob_matches, glob_count, sizeof(char*), compare_strings);
+    }
+    return glob_count;
+}
+
+// replace the args of cmd that are globs with their matches
+void expand_globs(struct Command *cmd) {
+    int argc = 0;
+    bool changed = false;
+    for (int i = 0; i < cmd->argc; i++) {
+        int count = glob_word(cmd->args[i]);
+        if (count == 0) {
+            if (changed) {
+                push_stage_arg(argc, cmd->args[i]);
+            }
+            argc++;
+            continue;
+        }
+        if (!changed) {
+            // stage the words before the first match
+            for (int j = 0; j < i; j++) {
+                push_stage_arg(j, cmd->args[j]);
+            }
+            changed = true;
+        }
+        for (int j = 0; j < count; j++) {
+            push_stage_arg(argc++, glob_matches[j]);
+        }
+    }
+    if (changed) {
+        cmd->args = arena_alloc(&line_arena, (argc + 1) * sizeof(char*));
+        memcpy(cmd->args, stage_args, argc * sizeof(char*));
+        cmd->args[argc] = NULL;
+        cmd->argc = argc;
+    }
+
+    // a redirect only takes a glob that names exactly one file
+    for (int i = 0; i < cmd->nredirects; i++) {
+        if (glob_word(cmd->redirects[i].file) == 1) {
+            cmd->redirects[i].file = glob_matches[0];
+        }
+    }
+}
+
+// A group is a line's pipelines up to the next ';', '&&' or '||', which are
+// expanded and run together
+struct Command *group_last(struct Command *group) {
+    while (group->connector == CONNECT_PARALLEL && group->next != NULL) {
+        group = group->next;
+    }
+    return group;
+}
+
+// the pipeline after group, or NULL
+struct Command *group_end(struct Command *group) {
+    return group_last(group)->next;
+}
+
+// expand the variables, then the globs, in the args and redirect files of
+// every command in group
+void expand_group(struct Command *group) {
+    dir_cache = NULL;
+    struct Command *end = group_end(group);
+    for (struct Command *pipeline = group; pipeline != end; pipeline = pipeline->next) {
+        for (struct Command *cmd = pipeline; cmd != NULL; cmd = cmd->pipe) {
+            for (int i = 0; i < cmd->argc; i++) {
+                cmd->args[i] = expand_word(cmd->args[i]);
+            }
+            for (int i = 0; i < cmd->nredirects; i++) {
+                cmd->redirects[i].file = expand_word(cmd->redirects[i].file);
+            }
+            expand_globs(cmd);
+            if (cmd->cmd != cmd->args[0]) {
+                // the command itself came from a variable or glob
+                cmd->cmd = cmd->args[0];
+                cmd->exe = NULL;
+            }
+        }
     }
-    return "";
 }
 
 void print_command(struct Command *curr_cmd) {
@@ -330,88 +1397,3522 @@ void print_command(struct Command *curr_cmd) {
     printf("\n");
 }
 
-void wish_execute(struct Command *curr_cmd) {
-    // run built-ins using syscalls
-    for (int i = 0; i < num_of_builtins(); i++) {
-        if (strcmp(curr_cmd->cmd, builtin_options[i]) == 0) {
-            (*builtin_func[i])(curr_cmd->argc, curr_cmd->args);
+// Everything the shell waits for goes through one epoll set: SIGCHLD, which
+// is blocked and read from a signalfd, and stdin while an interactive prompt
+// is waiting for a line. Each SIGCHLD wakeup reaps all exited children with
+// wait4(WNOHANG), so the shell never sits in a blocking wait() and
+// background jobs are noticed as soon as they finish.
+int event_fd = -1;
+int sigchld_fd = -1;
+int input_fd = -1;          // stdin, if it can be polled (see wait_event())
+sigset_t child_sigmask;     // children start with no signals blocked
+posix_spawnattr_t spawn_attr;
 
-            // TODO: free member variables of struct
-            free(curr_cmd);
-            return;
-        }
+void init_events(bool interactive) {
+    // SIGPIPE is blocked too, so in-process utilities writing to a closed
+    // pipe get EPIPE rather than killing the shell
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    sigemptyset(&child_sigmask);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd == -1 || sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        print_error();
+        exit(EXIT_FAILURE);
     }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1
+        || (sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = sigchld_fd };
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &event) == -1) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    posix_spawnattr_init(&spawn_attr);
+    posix_spawnattr_setsigmask(&spawn_attr, &child_sigmask);
+    posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK);
 
-    // run commands as child process
-    while (curr_cmd != NULL) {
-        //  print_command(curr_cmd);
-
-        // find cmd in $PATH
-        char *path = strdup(PATH);
-        char *exe = find_command_in_path(curr_cmd->cmd, path);
+    // stdin is only armed while the prompt waits (EPOLLONESHOT), and is read
+    // unbuffered so no typed-ahead lines hide in stdio where epoll can't see
+    // them. Regular files can't be polled, and are always readable anyway.
+    event.events = 0;
+    event.data.fd = STDIN_FILENO;
+    if (interactive && epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0) {
+        input_fd = STDIN_FILENO;
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+}
 
-        if (strlen(exe) == 0) {
+// Hook a forked child's stdin/stdout up to its pipeline neighbours, then
+// apply its redirect plan: one open per file, which is O_CLOEXEC so exec
+// closes it and only the dup2'd copies survive.
+void child_redirect(struct Command *cmd, int in_fd, int out_fd) {
+    if (in_fd != STDIN_FILENO) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < cmd->nredirects; i++) {
+        struct Redirect *redirect = &cmd->redirects[i];
+        int fd = open(redirect->file, redirect->flags | O_CLOEXEC, 0600);
+        if (fd < 0) {
             print_error();
-        } else {
-            // start process and execute commands
-            int ret = fork();
-            if (ret == 0) {
-                // child
-                if (curr_cmd->outfile) {
-                    int fd1 = open(curr_cmd->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-                    dup2(fd1, 1);
-                    close(fd1);
-                    int fd2 = open(curr_cmd->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-                    dup2(fd2, 1);
-                    close(fd2);
-                }
-                execv(exe, curr_cmd->args);
+            _exit(EXIT_FAILURE);
+        }
+        for (int target = STDIN_FILENO; target <= STDERR_FILENO; target++) {
+            if (redirect->fds & (1 << target)) {
+                dup2(fd, target);
+            }
+        }
+    }
+}
 
-                // TODO: exit with error code of execv
-                exit(0);
-            } else if (ret < 0) {
-                // failed to create process
-                print_error();
+// Exit status of a command that failed to start with error err, from exec
+// or (with posix_spawn) a redirect: 127 if exe doesn't exist, 126 if it
+// can't be executed, otherwise 1
+int exec_failure_status(char *exe, int err) {
+    struct stat st;
+    if (stat(exe, &st) != 0) {
+        return STATUS_NOT_FOUND;
+    }
+    if (!S_ISREG(st.st_mode) || access(exe, X_OK) != 0 || err == ENOEXEC) {
+        return STATUS_NOT_EXECUTABLE;
+    }
+    return EXIT_FAILURE;
+}
+
+pid_t fork_command(char *exe, struct Command *cmd, int in_fd, int out_fd) {
+    char **envp = child_environ();
+    pid_t ret = fork();
+    if (ret == 0) {
+        // child
+        diag_buffered = false;
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        child_redirect(cmd, in_fd, out_fd);
+        execve(exe, cmd->args, envp);
+        int status = exec_failure_status(exe, errno);
+        print_error();
+        _exit(status);
+    }
+    return ret;
+}
+
+#ifdef _POSIX_SPAWN
+pid_t posix_spawn_command(char *exe, struct Command *cmd, int in_fd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return -1;
+    }
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < cmd->nredirects; i++) {
+        // open onto the first descriptor, then copy it to the others
+        struct Redirect *redirect = &cmd->redirects[i];
+        int first = -1;
+        for (int target = STDIN_FILENO; target <= STDERR_FILENO; target++) {
+            if (!(redirect->fds & (1 << target))) {
+                continue;
+            }
+            if (first < 0) {
+                first = target;
+                posix_spawn_file_actions_addopen(&actions, target, redirect->file,
+                                                 redirect->flags, 0600);
+            } else {
+                posix_spawn_file_actions_adddup2(&actions, first, target);
             }
+        }
+    }
+
+    pid_t pid;
+    int result = posix_spawn(&pid, exe, &actions, &spawn_attr, cmd->args, child_environ());
+    posix_spawn_file_actions_destroy(&actions);
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    return pid;
+}
+#endif
+
+// -z: commands are forked from a per-executable zygote, a copy of the
+// command that wish-zygote.so has parked just before main() once its shared
+// libraries are loaded, so each run skips exec and dynamic linking.
+// See zygote.h for the protocol.
+#define MAX_ZYGOTES 32
+#define ZYGOTE_UNAVAILABLE -2
+
+bool zygote_mode = false;
+char *zygote_library = NULL;
+
+struct Zygote {
+    char *exe;
+    pid_t pid;
+    int sock;
+    bool usable;    // false if exe can't be run from a zygote
+    unsigned long env_generation;   // environment it was started with
+};
+
+struct Zygote zygotes[MAX_ZYGOTES];
+int num_zygotes = 0;
+
+// find wish-zygote.so next to the wish binary, and adopt the processes the
+// zygotes start so they can be waited for like our own children
+void init_zygotes() {
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    self[len] = '\0';
+    char *slash = strrchr(self, '/');
+    *slash = '\0';
+    zygote_library = malloc(strlen(self) + strlen("/wish-zygote.so") + 1);
+    if (zygote_library == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    sprintf(zygote_library, "%s/wish-zygote.so", self);
+    if (access(zygote_library, R_OK) != 0 || prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Only dynamically linked ELF executables go through ld.so (and so load the
+// zygote library), and preloading is ignored for setuid/setgid ones
+bool can_use_zygote(char *exe) {
+    struct stat st;
+    if (stat(exe, &st) != 0 || (st.st_mode & (S_ISUID | S_ISGID))) {
+        return false;
+    }
+    int fd = open(exe, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
 
-            // free space used for exe string
-            free(exe);
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)buf;
+    if (len < (ssize_t)sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        return false;
+    }
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        size_t offset = ehdr->e_phoff + i * sizeof(Elf64_Phdr);
+        if (offset + sizeof(Elf64_Phdr) > (size_t)len) {
+            break;
+        }
+        if (((Elf64_Phdr *)(buf + offset))->p_type == PT_INTERP) {
+            return true;
         }
+    }
+    return false;
+}
 
-        // iterate to next command in list
-        struct Command *temp = curr_cmd->next;
-        free(curr_cmd);
-        curr_cmd = temp;
+// start exe as a zygote, leaving it unusable if it doesn't check in
+void start_zygote(struct Zygote *zygote) {
+    zygote->usable = false;
+    zygote->pid = -1;
+    zygote->sock = -1;
+    if (!can_use_zygote(zygote->exe)) {
+        return;
+    }
 
-        free(path);
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        return;
+    }
+
+    // environment plus the preload and the zygote's socket, the zygote
+    // is replaced when the environment changes
+    char **base = child_environ();
+    zygote->env_generation = env_generation;
+    int envc = 0;
+    while (base[envc] != NULL) {
+        envc++;
+    }
+    char **envp = malloc((envc + 3) * sizeof(char*));
+    char *preload = malloc(strlen("LD_PRELOAD=") + strlen(zygote_library) + 1);
+    if (envp == NULL || preload == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    sprintf(preload, "LD_PRELOAD=%s", zygote_library);
+    char fd_env[32];
+    snprintf(fd_env, sizeof(fd_env), "%s=%d", ZYGOTE_FD_ENV, ZYGOTE_FD);
+    int n = 0;
+    envp[n++] = preload;
+    envp[n++] = fd_env;
+    for (int i = 0; i < envc; i++) {
+        if (strncmp(base[i], "LD_PRELOAD=", 11) != 0) {
+            envp[n++] = base[i];
+        }
+    }
+    envp[n] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        posix_spawn_file_actions_addopen(&actions, fd, "/dev/null", O_RDWR, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, sv[1], ZYGOTE_FD);
+    char *argv[] = {zygote->exe, NULL};
+    int result = posix_spawn(&zygote->pid, zygote->exe, &actions, &spawn_attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    free(preload);
+    free(envp);
+    close(sv[1]);
+    if (result != 0) {
+        close(sv[0]);
+        return;
     }
 
-    // Wait for all child processes to finish
-    while (wait(NULL) > 0);
+    // wait (briefly) for the zygote to report in
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char ready;
+    if (recv(sv[0], &ready, 1, 0) != 1 || ready != ZYGOTE_READY) {
+        close(sv[0]);
+        kill(zygote->pid, SIGKILL);
+        return;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    zygote->sock = sv[0];
+    zygote->usable = true;
 }
 
-int main(int argc, char *argv[]) {
-    // ensure proper arguments passed
-    validate_argv(argc, argv);
+struct Zygote *find_zygote(char *exe) {
+    for (int i = 0; i < num_zygotes; i++) {
+        if (strcmp(zygotes[i].exe, exe) == 0) {
+            if (zygotes[i].env_generation != env_generation) {
+                // its children would inherit a stale environment
+                if (zygotes[i].pid > 0) {
+                    kill(zygotes[i].pid, SIGKILL);
+                }
+                if (zygotes[i].sock >= 0) {
+                    close(zygotes[i].sock);
+                }
+                start_zygote(&zygotes[i]);
+            }
+            return &zygotes[i];
+        }
+    }
+    if (num_zygotes == MAX_ZYGOTES) {
+        return NULL;
+    }
+    struct Zygote *zygote = &zygotes[num_zygotes++];
+    zygote->exe = strdup(exe);
+    start_zygote(zygote);
+    return zygote;
+}
 
-    FILE *input = argc == 2 ? open_stream(argv[1], "r") : stdin;
+// send args and descriptors to the zygote, returning the pid it started
+pid_t zygote_request(struct Zygote *zygote, char *buf, size_t len, int *fds) {
+    char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(ZYGOTE_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, ZYGOTE_FDS * sizeof(int));
 
-    // run command loop
-    while (true) {
+    pid_t pid;
+    if (sendmsg(zygote->sock, &msg, MSG_NOSIGNAL) != (ssize_t)len
+        || recv(zygote->sock, &pid, sizeof(pid), 0) != sizeof(pid)) {
+        // the zygote died, don't try it again
+        close(zygote->sock);
+        zygote->usable = false;
+        return ZYGOTE_UNAVAILABLE;
+    }
+    return pid;
+}
 
-        // batch or interactive mode?
-        if (is_interactive_mode(argc)) {
-            print_ps1();
+// Run cmd from exe's zygote. The descriptors the command should see are
+// worked out here in the parent (pipes and the redirect plan) and passed to
+// the zygote. Returns ZYGOTE_UNAVAILABLE if the caller should spawn instead.
+pid_t zygote_command(char *exe, struct Command *cmd, int in_fd, int out_fd) {
+    struct Zygote *zygote = find_zygote(exe);
+    if (zygote == NULL || !zygote->usable) {
+        return ZYGOTE_UNAVAILABLE;
+    }
+
+    char buf[ZYGOTE_MSG_MAX];
+    size_t len = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        size_t arg_len = strlen(cmd->args[i]) + 1;
+        if (len + arg_len >= sizeof(buf)) {
+            return ZYGOTE_UNAVAILABLE;
+        }
+        memcpy(buf + len, cmd->args[i], arg_len);
+        len += arg_len;
+    }
+
+    int fds[ZYGOTE_FDS] = {in_fd, out_fd, STDERR_FILENO, -1};
+    int opened[MAX_REDIRECTS + 1];
+    int nopened = 0;
+    bool ok = true;
+    for (int i = 0; i < cmd->nredirects && ok; i++) {
+        struct Redirect *redirect = &cmd->redirects[i];
+        int fd = open(redirect->file, redirect->flags | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            ok = false;
+            break;
+        }
+        opened[nopened++] = fd;
+        for (int target = STDIN_FILENO; target <= STDERR_FILENO; target++) {
+            if (redirect->fds & (1 << target)) {
+                fds[target] = fd;
+            }
+        }
+    }
+    if (ok && (fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        opened[nopened++] = fds[3];
+    } else {
+        ok = false;
+    }
+
+    pid_t pid = -1;
+    if (ok) {
+        pid = zygote_request(zygote, buf, len, fds);
+    }
+    for (int i = 0; i < nopened; i++) {
+        close(opened[i]);
+    }
+    return pid;
+}
+
+// start exe with cmd's args and redirects, returning the child's pid or -1
+pid_t spawn_command(char *exe, struct Command *cmd, int in_fd, int out_fd) {
+    // errors from before the child can't come out after its output
+    diag_flush();
+    if (zygote_mode) {
+        pid_t pid = zygote_command(exe, cmd, in_fd, out_fd);
+        if (pid != ZYGOTE_UNAVAILABLE) {
+            return pid;
         }
+    }
+#ifdef _POSIX_SPAWN
+    if (spawn_backend == SPAWN_POSIX) {
+        return posix_spawn_command(exe, cmd, in_fd, out_fd);
+    }
+#endif
+    return fork_command(exe, cmd, in_fd, out_fd);
+}
 
-        // read line on input
-        char *line = wish_read_line(input);
+// `cat` of regular files inside a pipeline is done by a forked copy of the
+// shell with sendfile(), so the data never passes through user space and
+// cat itself is never exec'd. Set to 0 to always run the real cat.
+#define PIPE_FAST_CAT 1
 
-        // parse line into tokens
-        struct Command *cmd_list = wish_tokenize_line(line);
-        if (cmd_list) {
-            // execute each command in line as its own process (except built-ins)
-            wish_execute(cmd_list);
+bool is_fast_cat(struct Command *cmd) {
+    if (!PIPE_FAST_CAT || strcmp(cmd->cmd, "cat") != 0 || cmd->argc < 2) {
+        return false;
+    }
+    for (int i = 1; i < cmd->argc; i++) {
+        struct stat st;
+        if (cmd->args[i][0] == '-' || stat(cmd->args[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
         }
     }
+    return true;
+}
+
+pid_t fast_cat(struct Command *cmd, int in_fd, int out_fd) {
+    diag_flush();
+    pid_t ret = fork();
+    if (ret == 0) {
+        diag_buffered = false;
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        child_redirect(cmd, in_fd, out_fd);
+        int status = EXIT_SUCCESS;
+        for (int i = 1; i < cmd->argc; i++) {
+            int fd = open(cmd->args[i], O_RDONLY);
+            if (fd < 0) {
+                status = EXIT_FAILURE;
+                continue;
+            }
+            ssize_t sent;
+            while ((sent = sendfile(STDOUT_FILENO, fd, NULL, 1 << 30)) > 0);
+            if (sent < 0) {
+                status = EXIT_FAILURE;
+            }
+            close(fd);
+        }
+        _exit(status);
+    }
+    return ret;
+}
+
+// Utilities run inside the shell: a lone echo, true, false, test, [ or
+// small cat found in a system directory through PATH costs a function call
+// instead of a fork and exec. They write to the files they are redirected
+// to, and finish immediately, so a line's '&' and background semantics
+// still hold. -p (or anything else, like a pipeline or an unusual cat)
+// runs the real program.
+#define UTILITY_CAT_MAX (64 << 10)
+
+bool utilities_in_process = true;
+
+// the descriptors a utility sees as its stdin, stdout and stderr
+struct UtilityFds {
+    int fd[3];
+};
+
+// write all of len bytes, false if that fails (e.g. EPIPE)
+bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += written;
+        len -= written;
+    }
+    return true;
+}
+
+// status of a utility whose output couldn't be written
+int write_failed() {
+    return errno == EPIPE ? 128 + SIGPIPE : EXIT_FAILURE;
+}
+
+int utility_true(int argc, char *args[], struct UtilityFds *fds) {
+    return EXIT_SUCCESS;
+}
+
+int utility_false(int argc, char *args[], struct UtilityFds *fds) {
+    return EXIT_FAILURE;
+}
+
+int utility_echo(int argc, char *args[], struct UtilityFds *fds) {
+    // one write of the whole line, with -n leaving off the newline
+    int first = 1;
+    bool newline = true;
+    if (argc > 1 && strcmp(args[1], "-n") == 0) {
+        first = 2;
+        newline = false;
+    }
+    size_t len = 1;
+    for (int i = first; i < argc; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *line = arena_alloc(&line_arena, len);
+    char *p = line;
+    for (int i = first; i < argc; i++) {
+        if (i > first) {
+            *p++ = ' ';
+        }
+        size_t arg_len = strlen(args[i]);
+        memcpy(p, args[i], arg_len);
+        p += arg_len;
+    }
+    if (newline) {
+        *p++ = '\n';
+    }
+    return write_all(fds->fd[STDOUT_FILENO], line, p - line) ? EXIT_SUCCESS : write_failed();
+}
+
+// only run for regular files of at most UTILITY_CAT_MAX bytes in total
+int utility_cat(int argc, char *args[], struct UtilityFds *fds) {
+    char buf[UTILITY_CAT_MAX];
+    int status = EXIT_SUCCESS;
+    struct stat out;
+    bool out_is_file = fstat(fds->fd[STDOUT_FILENO], &out) == 0 && S_ISREG(out.st_mode);
+    for (int i = 1; i < argc; i++) {
+        int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            dprintf(fds->fd[STDERR_FILENO], "cat: %s: %s\n", args[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        struct stat in;
+        if (out_is_file && fstat(fd, &in) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+            // appending a file to itself would never reach its end
+            dprintf(fds->fd[STDERR_FILENO], "cat: %s: input file is output file\n", args[i]);
+            status = EXIT_FAILURE;
+            close(fd);
+            continue;
+        }
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            if (!write_all(fds->fd[STDOUT_FILENO], buf, len)) {
+                close(fd);
+                return write_failed();
+            }
+        }
+        if (len < 0) {
+            status = EXIT_FAILURE;
+        }
+        close(fd);
+    }
+    return status;
+}
+
+// test's integer operands, false (after complaining) if str isn't one
+bool test_integer(char *str, long *value, struct UtilityFds *fds) {
+    char *end;
+    errno = 0;
+    *value = strtol(str, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (errno != 0 || end == str || *end != '\0') {
+        dprintf(fds->fd[STDERR_FILENO], "test: invalid integer '%s'\n", str);
+        return false;
+    }
+    return true;
+}
+
+// 0 true, 1 false, 2 error, -1 if op isn't a unary operator
+int test_unary(char *op, char *arg, struct UtilityFds *fds) {
+    struct stat st;
+    if (strlen(op) != 2 || op[0] != '-') {
+        return -1;
+    }
+    switch (op[1]) {
+    case 'n': return strlen(arg) == 0;
+    case 'z': return strlen(arg) != 0;
+    case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) != 0;
+    case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) != 0;
+    case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) != 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+    case 't': {
+        long fd;
+        if (!test_integer(arg, &fd, fds)) {
+            return 2;
+        }
+        return !isatty(fd >= 0 && fd <= STDERR_FILENO ? fds->fd[fd] : fd);
+    }
+    }
+    if (strchr("bcdefgpsSu", op[1]) == NULL) {
+        return -1;
+    }
+    if (stat(arg, &st) != 0) {
+        return 1;
+    }
+    switch (op[1]) {
+    case 'b': return !S_ISBLK(st.st_mode);
+    case 'c': return !S_ISCHR(st.st_mode);
+    case 'd': return !S_ISDIR(st.st_mode);
+    case 'f': return !S_ISREG(st.st_mode);
+    case 'g': return !(st.st_mode & S_ISGID);
+    case 'p': return !S_ISFIFO(st.st_mode);
+    case 's': return st.st_size == 0;
+    case 'S': return !S_ISSOCK(st.st_mode);
+    case 'u': return !(st.st_mode & S_ISUID);
+    }
+    return 0;
+}
+
+bool timespec_after(struct timespec *a, struct timespec *b) {
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+// 0 true, 1 false, 2 error, -1 if op isn't a binary operator
+int test_binary(char *left, char *op, char *right, struct UtilityFds *fds) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) != 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat l, r;
+        bool have_l = stat(left, &l) == 0;
+        bool have_r = stat(right, &r) == 0;
+        if (op[1] == 'e') {
+            return !(have_l && have_r && l.st_dev == r.st_dev && l.st_ino == r.st_ino);
+        }
+        if (op[1] == 'o') {
+            return !(have_r && (!have_l || timespec_after(&r.st_mtim, &l.st_mtim)));
+        }
+        return !(have_l && (!have_r || timespec_after(&l.st_mtim, &r.st_mtim)));
+    }
+
+    char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, ops[i]) != 0) {
+            continue;
+        }
+        long l, r;
+        if (!test_integer(left, &l, fds) || !test_integer(right, &r, fds)) {
+            return 2;
+        }
+        bool result[] = {l == r, l != r, l < r, l <= r, l > r, l >= r};
+        return !result[i];
+    }
+    return -1;
+}
+
+// POSIX test, decided by the number of arguments (at most 4)
+int test_expression(int argc, char *args[], struct UtilityFds *fds) {
+    int result = -1;
+    switch (argc) {
+    case 0:
+        return 1;
+    case 1:
+        return strlen(args[0]) == 0;
+    case 2:
+        if (strcmp(args[0], "!") == 0) {
+            result = test_expression(1, &args[1], fds);
+            return result == 2 ? 2 : !result;
+        }
+        result = test_unary(args[0], args[1], fds);
+        break;
+    case 3:
+        result = test_binary(args[0], args[1], args[2], fds);
+        if (result < 0 && strcmp(args[0], "!") == 0) {
+            result = test_expression(2, &args[1], fds);
+            return result == 2 ? 2 : !result;
+        }
+        if (result < 0 && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+            return test_expression(1, &args[1], fds);
+        }
+        break;
+    case 4:
+        if (strcmp(args[0], "!") == 0) {
+            result = test_expression(3, &args[1], fds);
+            return result == 2 ? 2 : !result;
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+            return test_expression(2, &args[1], fds);
+        }
+        break;
+    }
+    if (result < 0) {
+        dprintf(fds->fd[STDERR_FILENO], "test: syntax error\n");
+        return 2;
+    }
+    return result;
+}
+
+int utility_test(int argc, char *args[], struct UtilityFds *fds) {
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            dprintf(fds->fd[STDERR_FILENO], "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expression(argc - 1, &args[1], fds);
+}
+
+char *utility_options[] = {
+  "echo",
+  "true",
+  "false",
+  "cat",
+  "test",
+  "["
+};
+
+int (*utility_func[]) (int argc, char **, struct UtilityFds *) = {
+  &utility_echo,
+  &utility_true,
+  &utility_false,
+  &utility_cat,
+  &utility_test,
+  &utility_test,
+};
+
+int num_of_utilities() {
+  return sizeof(utility_options) / sizeof(char *);
+}
+
+// The utility to run cmd with instead of exe, or -1. Only a command that
+// PATH finds in a system directory is replaced (a script's own 'echo' isn't),
+// and only when it can't block the shell: no reading stdin, no big files.
+int in_process_utility(struct Command *cmd, char *exe) {
+    if (!utilities_in_process || cmd->pipe != NULL
+        || (strncmp(exe, "/bin/", 5) != 0 && strncmp(exe, "/usr/bin/", 9) != 0)
+        || strcmp(strrchr(exe, '/') + 1, cmd->cmd) != 0) {
+        return -1;
+    }
+    int utility = -1;
+    for (int i = 0; i < num_of_utilities(); i++) {
+        if (strcmp(cmd->cmd, utility_options[i]) == 0) {
+            utility = i;
+        }
+    }
+    if (utility < 0) {
+        return -1;
+    }
+    if (utility_func[utility] == &utility_test) {
+        int operands = cmd->argc - 1 - (strcmp(cmd->cmd, "[") == 0);
+        return operands <= 4 ? utility : -1;
+    }
+    if (utility_func[utility] == &utility_cat) {
+        off_t total = 0;
+        for (int i = 1; i < cmd->argc; i++) {
+            struct stat st;
+            if (cmd->args[i][0] == '-' || stat(cmd->args[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+                return -1;
+            }
+            total += st.st_size;
+        }
+        return cmd->argc > 1 && total <= UTILITY_CAT_MAX ? utility : -1;
+    }
+    return utility;
+}
+
+// run a utility with cmd's redirects, returning its exit status
+int run_utility(int utility, struct Command *cmd) {
+    struct UtilityFds fds = {{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}};
+    int opened[MAX_REDIRECTS];
+    int status = EXIT_FAILURE;
+    int i;
+    diag_flush();
+    for (i = 0; i < cmd->nredirects; i++) {
+        struct Redirect *redirect = &cmd->redirects[i];
+        opened[i] = open(redirect->file, redirect->flags | O_CLOEXEC, 0600);
+        if (opened[i] < 0) {
+            print_error();
+            break;
+        }
+        for (int target = STDIN_FILENO; target <= STDERR_FILENO; target++) {
+            if (redirect->fds & (1 << target)) {
+                fds.fd[target] = opened[i];
+            }
+        }
+    }
+    if (i == cmd->nredirects) {
+        status = (*utility_func[utility])(cmd->argc, cmd->args, &fds);
+    }
+    while (--i >= 0) {
+        close(opened[i]);
+    }
+    return status;
+}
+
+int pipeline_length(struct Command *cmd) {
+    int length = 0;
+    for (; cmd != NULL; cmd = cmd->pipe) {
+        length++;
+    }
+    return length;
+}
+
+// Start every stage of the pipeline headed by cmd, connected with pipe(2).
+// The pids of the stages are stored in pids, -1 for stages that failed or
+// that were run in-process, whose exit status is stored in status.
+void launch_pipeline(struct Command *cmd, pid_t *pids, int *status) {
+    int in_fd = STDIN_FILENO;
+    for (int i = 0; cmd != NULL; cmd = cmd->pipe, i++) {
+        int fds[2] = {-1, STDOUT_FILENO};
+        if (cmd->pipe != NULL && pipe2(fds, O_CLOEXEC) == -1) {
+            print_error();
+            fds[0] = -1;
+            fds[1] = STDOUT_FILENO;
+        }
+
+        // find cmd in $PATH (or the hash of previously found commands),
+        // unless that was done when the script was compiled
+        char *exe = cmd->exe != NULL ? cmd->exe : hash_lookup(cmd->cmd);
+        pids[i] = -1;
+        status[i] = STATUS_NOT_FOUND;
+        int utility;
+        if (strlen(exe) == 0) {
+            print_error();
+        } else if (i == 0 && (utility = in_process_utility(cmd, exe)) >= 0) {
+            status[i] = run_utility(utility, cmd);
+        } else if (cmd->pipe != NULL && is_fast_cat(cmd)) {
+            if ((pids[i] = fast_cat(cmd, in_fd, fds[1])) < 0) {
+                print_error();
+            }
+        } else if ((pids[i] = spawn_command(exe, cmd, in_fd, fds[1])) < 0) {
+            // failed to create process
+            status[i] = exec_failure_status(exe, errno);
+            print_error();
+        }
+
+        // the children hold their own copies of the pipe ends now
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (fds[1] != STDOUT_FILENO) {
+            close(fds[1]);
+        }
+        in_fd = fds[0] == -1 ? STDIN_FILENO : fds[0];
+    }
+}
+
+// At most max_jobs '&' separated foreground pipelines run at once, the next
+// one is started as soon as a running one has been fully reaped. Background
+// lines (ending in '&') aren't limited, the job table grows to hold them.
+int max_jobs = 0;
+
+// -a: lines don't wait for each other. A line only waits for the jobs still
+// running (a barrier) when it is a builtin (cd, path, exit, wait, ...) or it
+// names or runs a file that a running job writes with a redirect, or writes
+// to a file that a running job names or runs. Files are compared by their
+// canonical paths, so 'out', './out' and '/dir/out' are the same file.
+bool async_mode = false;
+
+// a file a job names, runs or (with a redirect) writes, see canonical_file()
+struct JobFile {
+    char *path;
+    bool written;
+};
+
+// -t file: one record per command with its times and resource usage, as
+// CSV or, when file ends in .json/.jsonl, as JSON lines
+FILE *job_trace = NULL;
+bool trace_json = false;
+struct timespec shell_start;
+unsigned long line_number = 0;
+
+// -T: report every pipeline's times on stderr as if prefixed with 'time'
+bool time_all = false;
+
+struct Job {
+    bool active;
+    unsigned long seq;       // order in which jobs were started
+    unsigned long line;      // line of input the job came from
+    struct Command *cmd;
+    pid_t *pids;
+    int *status;
+    struct rusage *usage;    // per stage, from wait4()
+    struct timespec *ended;  // per stage reap time
+    int npids;
+    int size;                // capacity of the per stage arrays
+    int running;             // stages not yet reaped
+    struct timespec start;
+    struct timespec end;
+    bool background;         // from a line ending in '&'
+    int id;                  // job number shown by 'jobs', if background
+    struct Arena arena;      // copy of cmd in async mode or the background,
+                             // outliving its line
+    struct JobFile *files;   // in async mode, the files cmd uses
+    int nfiles;
+};
+
+struct Job *jobs = NULL;
+int job_slots = 0;
+int running_jobs = 0;          // foreground jobs not yet finished
+int running_background = 0;    // background jobs not yet finished
+unsigned long job_seq = 0;
+
+// background jobs are announced, and reported when done, at a prompt
+bool report_jobs = false;
+bool reported_done = false;    // the prompt needs printing again
+
+void init_jobs() {
+    job_slots = max_jobs;
+    jobs = calloc(job_slots, sizeof(struct Job));
+    if (jobs == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+}
+
+double seconds_since_start(struct timespec *ts) {
+    return (ts->tv_sec - shell_start.tv_sec) + (ts->tv_nsec - shell_start.tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// write cmd's args joined by spaces as a quoted CSV field or JSON string
+void trace_command(struct Command *cmd) {
+    fputc('"', job_trace);
+    for (int i = 0; i < cmd->argc; i++) {
+        if (i > 0) {
+            fputc(' ', job_trace);
+        }
+        for (char *c = cmd->args[i]; *c; c++) {
+            if (*c == '"') {
+                fputs(trace_json ? "\\\"" : "\"\"", job_trace);
+            } else if (trace_json && *c == '\\') {
+                fputs("\\\\", job_trace);
+            } else if (trace_json && (unsigned char)*c < 0x20) {
+                fprintf(job_trace, "\\u%04x", *c);
+            } else {
+                fputc(*c, job_trace);
+            }
+        }
+    }
+    fputc('"', job_trace);
+}
+
+void trace_header() {
+    if (!trace_json) {
+        fprintf(job_trace, "line,job,pid,command,status,start,end,real,user,sys,"
+                           "maxrss_kb,minflt,majflt,nvcsw,nivcsw\n");
+    }
+}
+
+void trace_job(struct Job *job) {
+    int i = 0;
+    for (struct Command *cmd = job->cmd; cmd != NULL; cmd = cmd->pipe, i++) {
+        if (job->pids[i] < 0) {
+            continue;
+        }
+
+        struct rusage *ru = &job->usage[i];
+        double start = seconds_since_start(&job->start);
+        double end = seconds_since_start(&job->ended[i]);
+        if (trace_json) {
+            fprintf(job_trace, "{\"line\":%lu,\"job\":%lu,\"pid\":%d,\"command\":",
+                    job->line, job->seq, job->pids[i]);
+            trace_command(cmd);
+            fprintf(job_trace, ",\"status\":%d,\"start\":%.6f,\"end\":%.6f,"
+                    "\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                    "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                    job->status[i], start, end, end - start,
+                    timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+                    ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+        } else {
+            fprintf(job_trace, "%lu,%lu,%d,", job->line, job->seq, job->pids[i]);
+            trace_command(cmd);
+            fprintf(job_trace, ",%d,%.6f,%.6f,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld\n",
+                    job->status[i], start, end, end - start,
+                    timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+                    ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+        }
+    }
+}
+
+// print a pipeline's times in the format of bash's 'time' keyword
+void time_job(struct Job *job) {
+    double user = 0, sys = 0;
+    for (int i = 0; i < job->npids; i++) {
+        user += timeval_seconds(&job->usage[i].ru_utime);
+        sys += timeval_seconds(&job->usage[i].ru_stime);
+    }
+    double real = (job->end.tv_sec - job->start.tv_sec)
+                  + (job->end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+    diag_flush();
+    char report[128];
+    int len = snprintf(report, sizeof(report), "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+                       (int)real / 60, real - 60 * ((int)real / 60),
+                       (int)user / 60, user - 60 * ((int)user / 60),
+                       (int)sys / 60, sys - 60 * ((int)sys / 60));
+    write(STDERR_FILENO, report, len);
+}
+
+char *arena_strdup(struct Arena *arena, char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+// name as an absolute path without symlinks, so different spellings of a file
+// compare equal: realpath() of name if it exists, else of its directory
+// followed by its last component, else name itself
+char *canonical_file(struct Arena *arena, char *name) {
+    char resolved[PATH_MAX];
+    if (realpath(name, resolved) != NULL) {
+        return arena_strdup(arena, resolved);
+    }
+    char *slash = strrchr(name, '/');
+    char *base = slash ? slash + 1 : name;
+    char dir[PATH_MAX];
+    size_t dir_len = slash == NULL ? 0 : slash == name ? 1 : (size_t)(slash - name);
+    if (dir_len >= sizeof(dir)) {
+        return arena_strdup(arena, name);
+    }
+    memcpy(dir, slash ? name : ".", slash ? dir_len : 1);
+    dir[slash ? dir_len : 1] = '\0';
+    if (realpath(dir, resolved) == NULL) {
+        return arena_strdup(arena, name);
+    }
+    size_t len = strlen(resolved);
+    char *path = arena_alloc(arena, len + strlen(base) + 2);
+    memcpy(path, resolved, len);
+    if (len > 1) {
+        path[len++] = '/';
+    }
+    strcpy(path + len, base);
+    return path;
+}
+
+// the files a pipeline uses, canonicalized into arena: the programs it runs,
+// its args and its redirects, which are written unless they are '<'
+struct JobFile *pipeline_files(struct Arena *arena, struct Command *pipeline, int *nfiles) {
+    int n = 0;
+    for (struct Command *cmd = pipeline; cmd != NULL; cmd = cmd->pipe) {
+        n += cmd->argc + cmd->nredirects;
+    }
+    struct JobFile *files = arena_alloc(arena, n * sizeof(struct JobFile));
+    n = 0;
+    for (struct Command *cmd = pipeline; cmd != NULL; cmd = cmd->pipe) {
+        char *exe = cmd->exe != NULL ? cmd->exe : hash_lookup(cmd->cmd);
+        if (strlen(exe) > 0) {
+            files[n++] = (struct JobFile){canonical_file(arena, exe), false};
+        }
+        for (int i = 1; i < cmd->argc; i++) {
+            files[n++] = (struct JobFile){canonical_file(arena, cmd->args[i]), false};
+        }
+        for (int i = 0; i < cmd->nredirects; i++) {
+            bool written = !(cmd->redirects[i].fds & REDIRECT_STDIN);
+            files[n++] = (struct JobFile){canonical_file(arena, cmd->redirects[i].file), written};
+        }
+    }
+    *nfiles = n;
+    return files;
+}
+
+// deep copy a pipeline so it stays valid after the line arena is reset
+struct Command *copy_pipeline(struct Arena *arena, struct Command *cmd) {
+    struct Command *head = NULL;
+    struct Command *tail = NULL;
+    for (; cmd != NULL; cmd = cmd->pipe) {
+        struct Command *node = arena_alloc(arena, sizeof(struct Command));
+        *node = *cmd;
+        node->args = arena_alloc(arena, (cmd->argc + 1) * sizeof(char*));
+        for (int i = 0; i < cmd->argc; i++) {
+            node->args[i] = arena_strdup(arena, cmd->args[i]);
+        }
+        node->args[cmd->argc] = NULL;
+        node->cmd = node->args[0];
+        if (cmd->exe != NULL) {
+            node->exe = arena_strdup(arena, cmd->exe);
+        }
+        for (int i = 0; i < cmd->nredirects; i++) {
+            node->redirects[i].file = arena_strdup(arena, cmd->redirects[i].file);
+        }
+        node->pipe = NULL;
+        node->next = NULL;
+        if (head == NULL) {
+            head = node;
+        } else {
+            tail->pipe = node;
+        }
+        tail = node;
+    }
+    return head;
+}
+
+// "[id] state\tcmd | cmd ...", as listed by 'jobs'
+void print_job(FILE *out, struct Job *job, char *state) {
+    diag_flush();
+    fprintf(out, "[%d] %s\t", job->id, state);
+    for (struct Command *cmd = job->cmd; cmd != NULL; cmd = cmd->pipe) {
+        for (int i = 0; i < cmd->argc; i++) {
+            fprintf(out, i > 0 ? " %s" : "%s", cmd->args[i]);
+        }
+        if (cmd->pipe != NULL) {
+            fputs(" | ", out);
+        }
+    }
+    fputc('\n', out);
+    fflush(out);
+}
+
+void finish_job(struct Job *job) {
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    if (job_trace) {
+        trace_job(job);
+    }
+    if (time_all || job->cmd->timed) {
+        time_job(job);
+    }
+
+    // the most recently started pipeline provides pipestatus
+    if (job->seq == job_seq) {
+        if (job->npids > pipestatus_size) {
+            pipestatus_size = job->npids;
+            pipestatus = realloc(pipestatus, pipestatus_size * sizeof(int));
+            if (!pipestatus) {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+        }
+        pipestatus_count = job->npids;
+        memcpy(pipestatus, job->status, job->npids * sizeof(int));
+        last_status = job->status[job->npids - 1];
+    }
+    if (job->background && report_jobs) {
+        editor_hide();
+        print_job(stderr, job, "Done");
+        reported_done = true;
+    }
+    job->active = false;
+}
+
+// record the exit of pid, a stage of one of the active jobs
+void record_exit(pid_t pid, int status, struct rusage *usage) {
+    for (int i = 0; i < job_slots; i++) {
+        struct Job *job = &jobs[i];
+        if (!job->active) {
+            continue;
+        }
+        for (int j = 0; j < job->npids; j++) {
+            if (job->pids[j] == pid) {
+                job->status[j] = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                                     : WEXITSTATUS(status);
+                job->usage[j] = *usage;
+                clock_gettime(CLOCK_MONOTONIC, &job->ended[j]);
+                if (--job->running == 0) {
+                    if (job->background) {
+                        running_background--;
+                    } else {
+                        running_jobs--;
+                    }
+                    finish_job(job);
+                }
+                return;
+            }
+        }
+    }
+}
+
+// reap every child that has exited so far, without blocking
+void reap_children() {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        record_exit(pid, status, &usage);
+    }
+}
+
+// Sleep until children exit, and reap them, or, with want_input, until
+// stdin is readable. Returns true if stdin is readable.
+bool wait_event(bool want_input) {
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = input_fd };
+    diag_flush();
+    if (want_input) {
+        if (input_fd < 0) {
+            return true;
+        }
+        epoll_ctl(event_fd, EPOLL_CTL_MOD, input_fd, &event);
+    }
+
+    struct epoll_event events[2];
+    bool readable = false;
+    int n;
+    while ((n = epoll_wait(event_fd, events, 2, -1)) == -1 && errno == EINTR);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == sigchld_fd) {
+            // signals don't queue, one wakeup can stand for many exits
+            struct signalfd_siginfo info;
+            while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info));
+            reap_children();
+        } else {
+            readable = true;
+        }
+    }
+    if (want_input && !readable) {
+        // disarm stdin again until the next wait for input
+        event.events = 0;
+        epoll_ctl(event_fd, EPOLL_CTL_MOD, input_fd, &event);
+    }
+    return readable;
+}
+
+// barrier: wait until every running foreground job has finished
+void wait_foreground_jobs() {
+    while (running_jobs > 0) {
+        wait_event(false);
+    }
+}
+
+// wait until every job, including those in the background, has finished
+void wait_all_jobs() {
+    while (running_jobs > 0 || running_background > 0) {
+        wait_event(false);
+    }
+}
+
+struct Job *free_job_slot() {
+    for (int i = 0; i < job_slots; i++) {
+        if (!jobs[i].active) {
+            return &jobs[i];
+        }
+    }
+    // only background jobs can fill the table, make room for more
+    jobs = realloc(jobs, 2 * job_slots * sizeof(struct Job));
+    if (jobs == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    memset(&jobs[job_slots], 0, job_slots * sizeof(struct Job));
+    job_slots *= 2;
+    return &jobs[job_slots / 2];
+}
+
+// background jobs are numbered one past the highest still running
+int next_job_id() {
+    int id = 0;
+    for (int i = 0; i < job_slots; i++) {
+        if (jobs[i].active && jobs[i].background && jobs[i].id > id) {
+            id = jobs[i].id;
+        }
+    }
+    return id + 1;
+}
+
+void start_job(struct Command *cmd) {
+    // wait for a free slot
+    while (!cmd->background && running_jobs >= max_jobs) {
+        wait_event(false);
+    }
+    struct Job *job = free_job_slot();
+
+    job->background = cmd->background;
+    job->id = job->background ? next_job_id() : 0;
+    if (async_mode || job->background) {
+        arena_reset(&job->arena);
+        cmd = copy_pipeline(&job->arena, cmd);
+    }
+    // resolved now, as later lines can change the directory or PATH
+    job->nfiles = 0;
+    job->files = async_mode ? pipeline_files(&job->arena, cmd, &job->nfiles) : NULL;
+    job->active = true;
+    job->seq = ++job_seq;
+    job->line = line_number;
+    job->cmd = cmd;
+    job->npids = pipeline_length(cmd);
+    if (job->npids > job->size) {
+        job->size = job->npids;
+        job->pids = realloc(job->pids, job->size * sizeof(pid_t));
+        job->status = realloc(job->status, job->size * sizeof(int));
+        job->usage = realloc(job->usage, job->size * sizeof(struct rusage));
+        job->ended = realloc(job->ended, job->size * sizeof(struct timespec));
+        if (!job->pids || !job->status || !job->usage || !job->ended) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //  print_command(cmd);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    launch_pipeline(cmd, job->pids, job->status);
+    job->running = 0;
+    memset(job->usage, 0, job->npids * sizeof(struct rusage));
+    for (int i = 0; i < job->npids; i++) {
+        job->ended[i] = job->start;
+        if (job->pids[i] >= 0) {
+            job->running++;
+        }
+    }
+    if (job->running == 0) {
+        finish_job(job);
+    } else if (job->background) {
+        running_background++;
+        if (report_jobs) {
+            diag_flush();
+            fprintf(stderr, "[%d] %d\n", job->id, job->pids[job->npids - 1]);
+        }
+    } else {
+        running_jobs++;
+    }
+}
+
+int wish_jobs(int argc, char *args[]) {
+    // check exactly no args are passed to jobs
+    if (argc != 1) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+    // don't list the ones that have exited since we last looked
+    reap_children();
+    for (int id = 1, left = running_background; left > 0; id++) {
+        for (int i = 0; i < job_slots; i++) {
+            if (jobs[i].active && jobs[i].background && jobs[i].id == id) {
+                print_job(stdout, &jobs[i], "Running");
+                left--;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// does a running job write one of files, or use one that files writes?
+bool running_job_uses(struct JobFile *files, int nfiles) {
+    for (int i = 0; i < job_slots; i++) {
+        if (!jobs[i].active) {
+            continue;
+        }
+        for (int j = 0; j < jobs[i].nfiles; j++) {
+            for (int k = 0; k < nfiles; k++) {
+                if ((jobs[i].files[j].written || files[k].written)
+                    && strcmp(jobs[i].files[j].path, files[k].path) == 0) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// does the group touch a file that a running job is writing (or vice versa)?
+bool depends_on_running_jobs(struct Command *group) {
+    struct Command *end = group_end(group);
+    for (struct Command *pipeline = group; pipeline != end; pipeline = pipeline->next) {
+        int nfiles;
+        struct JobFile *files = pipeline_files(&line_arena, pipeline, &nfiles);
+        if (running_job_uses(files, nfiles)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the command a builtin was run from, for builtins that need its redirects
+struct Command *builtin_cmd = NULL;
+
+// run the '&' separated pipelines of a group
+void execute_group(struct Command *curr_cmd) {
+    struct Command *end = group_end(curr_cmd);
+
+    // NAME=value ... sets shell variables, once the jobs before it are done
+    if (is_assignment(curr_cmd->cmd)) {
+        wait_foreground_jobs();
+        for (int i = 0; i < curr_cmd->argc; i++) {
+            if (!is_assignment(curr_cmd->args[i]) || curr_cmd->pipe || curr_cmd->next != end
+                || curr_cmd->nredirects) {
+                // only whole lines of assignments, not 'NAME=value cmd'
+                print_error();
+                last_status = EXIT_FAILURE;
+                return;
+            }
+        }
+        for (int i = 0; i < curr_cmd->argc; i++) {
+            set_variable(curr_cmd->args[i], false);
+        }
+        last_status = EXIT_SUCCESS;
+        return;
+    }
+
+    // run built-ins using syscalls, once the foreground jobs before them are
+    // done (exit and wait also wait for the background ones)
+    for (int i = 0; i < num_of_builtins(); i++) {
+        if (strcmp(curr_cmd->cmd, builtin_options[i]) == 0) {
+            wait_foreground_jobs();
+            builtin_cmd = curr_cmd;
+            last_status = (*builtin_func[i])(curr_cmd->argc, curr_cmd->args);
+            return;
+        }
+    }
+
+    if (async_mode && running_jobs + running_background > 0 && depends_on_running_jobs(curr_cmd)) {
+        wait_all_jobs();
+    }
+
+    // run commands as child processes, one job per '&' separated pipeline
+    for (; curr_cmd != end; curr_cmd = curr_cmd->next) {
+        start_job(curr_cmd);
+    }
+
+    // Wait for all child processes to finish, except in the background
+    if (!async_mode) {
+        wait_foreground_jobs();
+    }
+}
+
+// Run a tokenized line group by group. Each group is expanded (if expand is
+// set) just before it runs, so it sees the $? of the groups before it. A
+// group after '&&' or '||' whose condition fails is skipped without being
+// expanded or starting anything, and leaves $? as it was.
+void wish_execute(struct Command *line, bool expand) {
+    struct Command *group = line;
+    while (group != NULL) {
+        struct Command *last = group_last(group);
+        if (expand) {
+            expand_group(group);
+        }
+        execute_group(group);
+        if ((group = last->next) == NULL) {
+            break;
+        }
+
+        // the rest of the line needs the group's status, even with -a
+        wait_foreground_jobs();
+        while (group != NULL && ((last->connector == CONNECT_AND && last_status != 0)
+                                 || (last->connector == CONNECT_OR && last_status == 0))) {
+            last = group_last(group);
+            group = last->next;
+        }
+    }
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// bench N [--parallel K] cmd args...: run cmd N times through execute_group()
+// (K '&' separated copies at a time) and report launch-to-exit latency
+int wish_bench(int argc, char *args[]) {
+    int runs = argc > 2 ? atoi(args[1]) : 0;
+    int parallel = 1;
+    int first = 2;
+    if (argc > 4 && strcmp(args[2], "--parallel") == 0) {
+        parallel = atoi(args[3]);
+        first = 4;
+    }
+    if (runs < 1 || parallel < 1 || first >= argc) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+
+    // K copies of the command, with any redirects given to bench
+    struct Command *copies = arena_alloc(&line_arena, parallel * sizeof(struct Command));
+    for (int i = 0; i < parallel; i++) {
+        copies[i] = *builtin_cmd;
+        copies[i].cmd = args[first];
+        copies[i].args = &args[first];
+        copies[i].argc = argc - first;
+        copies[i].background = false;
+        copies[i].connector = CONNECT_PARALLEL;
+        copies[i].pipe = NULL;
+        copies[i].next = i + 1 < parallel ? &copies[i + 1] : NULL;
+    }
+
+    double *latency = malloc(runs * sizeof(double));
+    if (latency == NULL) {
+        print_error();
+        return EXIT_FAILURE;
+    }
+    struct timespec start, end;
+    double total = 0;
+    for (int i = 0; i < runs; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute_group(copies);
+        wait_foreground_jobs();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[i] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        total += latency[i];
+    }
+
+    // p99 by nearest rank: the ceil(runs * 0.99)th latency, computed in
+    // integers so 100 runs gives the 99th, not the maximum
+    qsort(latency, runs, sizeof(double), compare_doubles);
+    int p99 = (int)(((long)runs * 99 + 99) / 100) - 1;
+    if (p99 < 0) {
+        p99 = 0;
+    }
+    printf("bench: %d runs of %s, %d at a time\n", runs, args[first], parallel);
+    printf("latency ms: min %.3f median %.3f p99 %.3f max %.3f\n",
+           latency[0] * 1e3, latency[runs / 2] * 1e3,
+           latency[p99] * 1e3, latency[runs - 1] * 1e3);
+    printf("throughput: %.1f launches/sec\n", runs * parallel / total);
+    fflush(stdout);
+    free(latency);
+    return EXIT_SUCCESS;
+}
+
+bool parse_only = false;
+
+// Compiled scripts (wish --compile script.wsh -o script.wshc) hold the
+// parsed lines of a batch file laid out to be run straight from an mmap'd
+// image: a header, then arrays of lines, commands, redirects, args and a
+// table of NUL terminated strings. Every field is 32 bits, strings are
+// offsets into the table (each distinct string is stored once) and commands
+// refer to each other (pipe/next) by index. A command
+// found in an absolute PATH directory when compiling (following any 'path'
+// lines before it) carries the path it resolved to, others are looked up
+// when run.
+#define COMPILED_MAGIC "WSHC"
+#define COMPILED_VERSION 2
+#define COMPILED_NONE UINT32_MAX
+#define COMPILED_TIMED 1
+#define COMPILED_BACKGROUND 2
+#define COMPILED_CONNECTOR_SHIFT 2     // flags bits 2-3 hold the Connector
+
+struct CompiledHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t nlines;
+    uint32_t ncommands;
+    uint32_t nredirects;
+    uint32_t nargs;
+    uint32_t strings_size;
+};
+
+struct CompiledLine {
+    uint32_t number;     // line of the source file
+    uint32_t errors;     // malformed pipelines, reported when run
+    uint32_t first;      // its commands are first .. first + count - 1
+    uint32_t count;
+};
+
+struct CompiledRedirect {
+    uint32_t fds;
+    uint32_t flags;
+    uint32_t file;
+};
+
+struct CompiledCommand {
+    uint32_t argc;
+    uint32_t args;       // index of its first arg
+    uint32_t exe;        // string, or COMPILED_NONE
+    uint32_t pipe;       // command index, or COMPILED_NONE
+    uint32_t next;
+    uint32_t flags;      // COMPILED_TIMED, COMPILED_BACKGROUND, connector
+    uint32_t redirects;  // index of its first redirect
+    uint32_t nredirects;
+};
+
+// a section of the image being compiled
+struct Section {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+// append len bytes to section, returning the offset they were put at
+uint32_t section_append(struct Section *section, const void *data, size_t len) {
+    if (section->len + len > section->size) {
+        section->size = 2 * (section->len + len);
+        section->data = realloc(section->data, section->size);
+        if (section->data == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(section->data + section->len, data, len);
+    section->len += len;
+    if (section->len > UINT32_MAX) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    return section->len - len;
+}
+
+// Strings of the image being compiled: an open addressing table of offsets
+// into the section makes sure each distinct string is only stored once
+struct StringTable {
+    struct Section data;
+    uint32_t *slots;     // offset + 1 of a string, 0 if empty
+    size_t nslots;
+    size_t count;
+};
+
+uint32_t intern_string(struct StringTable *table, char *str) {
+    if (2 * (table->count + 1) > table->nslots) {
+        // grow, rehashing the strings already stored
+        size_t nslots = table->nslots ? 2 * table->nslots : 1024;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        if (slots == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < table->nslots; i++) {
+            if (table->slots[i] != 0) {
+                size_t slot = fnv1a(table->data.data + table->slots[i] - 1) & (nslots - 1);
+                while (slots[slot] != 0) {
+                    slot = (slot + 1) & (nslots - 1);
+                }
+                slots[slot] = table->slots[i];
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->nslots = nslots;
+    }
+
+    size_t slot = fnv1a(str) & (table->nslots - 1);
+    while (table->slots[slot] != 0) {
+        if (strcmp(table->data.data + table->slots[slot] - 1, str) == 0) {
+            return table->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (table->nslots - 1);
+    }
+    uint32_t offset = section_append(&table->data, str, strlen(str) + 1);
+    table->slots[slot] = offset + 1;
+    table->count++;
+    return offset;
+}
+
+bool is_builtin(char *name) {
+    for (int i = 0; i < num_of_builtins(); i++) {
+        if (strcmp(name, builtin_options[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// where cmd will be found when run, if that can be known now: PATH relative
+// directories depend on the directory the script is run from
+uint32_t compile_exe(struct StringTable *strings, char *cmd) {
+    if (is_builtin(cmd) || strlen(PATH) == 0 || strpbrk(cmd, "$*?[") != NULL) {
+        return COMPILED_NONE;
+    }
+    for (char *dir = PATH; dir != NULL; dir = strchr(dir, ':') ? strchr(dir, ':') + 1 : NULL) {
+        if (*dir != '/') {
+            return COMPILED_NONE;
+        }
+    }
+    char *exe = hash_lookup(cmd);
+    if (strlen(exe) == 0) {
+        return COMPILED_NONE;
+    }
+    return intern_string(strings, exe);
+}
+
+// the sections of an image being compiled
+struct CompiledSections {
+    struct Section lines;
+    struct Section commands;
+    struct Section redirects;
+    struct Section args;
+    struct StringTable strings;
+    bool dynamic_path;      // PATH can change in ways only known when run
+};
+
+void compile_command(struct CompiledSections *image, struct Command *cmd,
+                     uint32_t pipe, uint32_t next) {
+    struct CompiledCommand compiled = {0};
+    compiled.argc = cmd->argc;
+    compiled.args = image->args.len / sizeof(uint32_t);
+    for (int i = 0; i < cmd->argc; i++) {
+        uint32_t arg = intern_string(&image->strings, cmd->args[i]);
+        section_append(&image->args, &arg, sizeof(arg));
+    }
+    compiled.exe = image->dynamic_path ? COMPILED_NONE : compile_exe(&image->strings, cmd->cmd);
+    compiled.pipe = pipe;
+    compiled.next = next;
+    compiled.flags = (cmd->timed ? COMPILED_TIMED : 0) | (cmd->background ? COMPILED_BACKGROUND : 0)
+                     | cmd->connector << COMPILED_CONNECTOR_SHIFT;
+    compiled.redirects = image->redirects.len / sizeof(struct CompiledRedirect);
+    compiled.nredirects = cmd->nredirects;
+    for (int i = 0; i < cmd->nredirects; i++) {
+        struct CompiledRedirect redirect;
+        redirect.fds = cmd->redirects[i].fds;
+        redirect.flags = cmd->redirects[i].flags;
+        redirect.file = intern_string(&image->strings, cmd->redirects[i].file);
+        section_append(&image->redirects, &redirect, sizeof(redirect));
+    }
+    section_append(&image->commands, &compiled, sizeof(compiled));
+}
+
+// whether a 'path' in cmd_list can be replayed while compiling: only when it
+// always runs, as the first command of a line outside any if/while/for, and
+// its args are known. Other 'path' commands make dynamic set.
+bool static_path(struct Command *cmd_list, int depth, bool *dynamic) {
+    bool replay = false;
+    for (struct Command *pipeline = cmd_list; pipeline != NULL; pipeline = pipeline->next) {
+        for (struct Command *cmd = pipeline; cmd != NULL; cmd = cmd->pipe) {
+            // the condition of an if or while is a command too
+            int word = (strcmp(cmd->cmd, "if") == 0 || strcmp(cmd->cmd, "while") == 0) && cmd->argc > 1;
+            if (strcmp(cmd->args[word], "path") != 0) {
+                continue;
+            }
+            bool known = cmd == cmd_list && word == 0 && depth == 0;
+            for (int i = 1; known && i < cmd->argc; i++) {
+                known = strpbrk(cmd->args[i], "$*?[") == NULL;
+            }
+            replay |= known;
+            *dynamic |= !known;
+        }
+    }
+    return replay;
+}
+
+// parse every line of source and write the compiled image to output
+void compile_script(char *source, char *output) {
+    if (access(source, R_OK) != 0) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    struct InputSource input = open_input(source);
+    struct CompiledSections image = {0};
+    size_t len;
+    char *text;
+    uint32_t number = 0;
+    int depth = 0;          // if/while/for blocks the line is in
+    while ((text = wish_read_line(&input, &len)) != NULL) {
+        arena_reset(&line_arena);
+        number++;
+        struct Command *cmd_list = wish_tokenize_line(text, len);
+        if (cmd_list == NULL && parse_errors == 0) {
+            continue;
+        }
+
+        // 'path' lines change where the commands after them are found. Once
+        // that can't be followed here, commands are looked up when run.
+        bool replay = cmd_list != NULL && static_path(cmd_list, depth, &image.dynamic_path);
+
+        struct CompiledLine line = {0};
+        line.number = number;
+        line.errors = parse_errors;
+        line.first = image.commands.len / sizeof(struct CompiledCommand);
+        uint32_t index = line.first;
+        for (struct Command *pipeline = cmd_list; pipeline != NULL; pipeline = pipeline->next) {
+            uint32_t next = index + pipeline_length(pipeline);
+            for (struct Command *cmd = pipeline; cmd != NULL; cmd = cmd->pipe, index++) {
+                compile_command(&image, cmd, cmd->pipe ? index + 1 : COMPILED_NONE,
+                                cmd == pipeline && pipeline->next ? next : COMPILED_NONE);
+            }
+        }
+        line.count = index - line.first;
+        section_append(&image.lines, &line, sizeof(line));
+
+        if (replay && !image.dynamic_path) {
+            wish_path(cmd_list->argc, cmd_list->args);
+        }
+        if (cmd_list != NULL) {
+            char *cmd = cmd_list->cmd;
+            if (strcmp(cmd, "if") == 0 || strcmp(cmd, "while") == 0 || strcmp(cmd, "for") == 0) {
+                depth++;
+            } else if ((strcmp(cmd, "fi") == 0 || strcmp(cmd, "done") == 0) && depth > 0) {
+                depth--;
+            }
+        }
+    }
+    close_input(&input);
+
+    struct CompiledHeader header = {0};
+    memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+    header.version = COMPILED_VERSION;
+    header.nlines = image.lines.len / sizeof(struct CompiledLine);
+    header.ncommands = image.commands.len / sizeof(struct CompiledCommand);
+    header.nredirects = image.redirects.len / sizeof(struct CompiledRedirect);
+    header.nargs = image.args.len / sizeof(uint32_t);
+    header.strings_size = image.strings.data.len;
+
+    FILE *out = fopen(output, "we");
+    if (out == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    struct Section *sections[] = {&image.lines, &image.commands, &image.redirects,
+                                  &image.args, &image.strings.data};
+    for (int i = 0; i < 5; i++) {
+        if (sections[i]->len > 0) {
+            fwrite(sections[i]->data, sections[i]->len, 1, out);
+        }
+        free(sections[i]->data);
+    }
+    free(image.strings.slots);
+    if (fclose(out) != 0) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+}
+
+struct CompiledImage {
+    struct CompiledHeader *header;
+    struct CompiledLine *lines;
+    struct CompiledCommand *commands;
+    struct CompiledRedirect *redirects;
+    uint32_t *args;
+    char *strings;
+};
+
+bool is_compiled_script(char *filename) {
+    char magic[4];
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool compiled = read(fd, magic, sizeof(magic)) == sizeof(magic)
+                    && memcmp(magic, COMPILED_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return compiled;
+}
+
+// string at offset in the image's table, the table is known to end in a NUL
+char *compiled_string(struct CompiledImage *image, uint32_t offset) {
+    if (offset >= image->header->strings_size) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    return image->strings + offset;
+}
+
+// Rebuild a line's commands in line_arena, pointing at the image's strings.
+// Indexes are checked as they are followed, a bad image is an error.
+struct Command *load_compiled_line(struct CompiledImage *image, struct CompiledLine *line) {
+    struct Command *nodes = arena_alloc(&line_arena, line->count * sizeof(struct Command));
+    for (uint32_t i = 0; i < line->count; i++) {
+        struct CompiledCommand *compiled = &image->commands[line->first + i];
+        struct Command *node = &nodes[i];
+        bool bad_link = false;
+        uint32_t links[2] = {compiled->pipe, compiled->next};
+        for (int j = 0; j < 2; j++) {
+            bad_link |= links[j] != COMPILED_NONE
+                        && (links[j] <= line->first + i || links[j] - line->first >= line->count);
+        }
+        if (compiled->argc == 0 || compiled->nredirects > MAX_REDIRECTS || bad_link
+            || compiled->redirects > image->header->nredirects
+            || compiled->nredirects > image->header->nredirects - compiled->redirects
+            || compiled->args > image->header->nargs
+            || compiled->argc > image->header->nargs - compiled->args) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+
+        node->argc = compiled->argc;
+        node->args = arena_alloc(&line_arena, (compiled->argc + 1) * sizeof(char*));
+        for (uint32_t j = 0; j < compiled->argc; j++) {
+            node->args[j] = compiled_string(image, image->args[compiled->args + j]);
+        }
+        node->args[compiled->argc] = NULL;
+        node->cmd = node->args[0];
+        node->exe = compiled->exe == COMPILED_NONE ? NULL : compiled_string(image, compiled->exe);
+        node->nredirects = compiled->nredirects;
+        for (uint32_t j = 0; j < compiled->nredirects; j++) {
+            struct CompiledRedirect *redirect = &image->redirects[compiled->redirects + j];
+            node->redirects[j].fds = redirect->fds;
+            node->redirects[j].flags = redirect->flags;
+            node->redirects[j].file = compiled_string(image, redirect->file);
+        }
+        node->timed = compiled->flags & COMPILED_TIMED;
+        node->background = compiled->flags & COMPILED_BACKGROUND;
+        node->connector = (compiled->flags >> COMPILED_CONNECTOR_SHIFT) & 3;
+        node->pipe = compiled->pipe == COMPILED_NONE ? NULL : &nodes[compiled->pipe - line->first];
+        node->next = compiled->next == COMPILED_NONE ? NULL : &nodes[compiled->next - line->first];
+    }
+    return line->count > 0 ? nodes : NULL;
+}
+
+// map a compiled script, checking its sections fit the file
+struct CompiledImage map_compiled_script(char *filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct CompiledHeader)) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    struct CompiledImage image;
+    image.header = (struct CompiledHeader *)map;
+    uint64_t size = sizeof(struct CompiledHeader)
+                    + (uint64_t)image.header->nlines * sizeof(struct CompiledLine)
+                    + (uint64_t)image.header->ncommands * sizeof(struct CompiledCommand)
+                    + (uint64_t)image.header->nredirects * sizeof(struct CompiledRedirect)
+                    + (uint64_t)image.header->nargs * sizeof(uint32_t)
+                    + image.header->strings_size;
+    if (image.header->version != COMPILED_VERSION || size != (uint64_t)st.st_size
+        || (image.header->strings_size > 0 && map[st.st_size - 1] != '\0')) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    image.lines = (struct CompiledLine *)(image.header + 1);
+    image.commands = (struct CompiledCommand *)(image.lines + image.header->nlines);
+    image.redirects = (struct CompiledRedirect *)(image.commands + image.header->ncommands);
+    image.args = (uint32_t *)(image.redirects + image.header->nredirects);
+    image.strings = (char *)(image.args + image.header->nargs);
+
+    return image;
+}
+
+// Line editor: at an interactive prompt on a terminal (or on any stdin with
+// -e) lines are read in raw mode and edited in place:
+//   left/right ^B/^F, home/end ^A/^E   move the cursor
+//   backspace, delete, ^D              delete a character (^D on an empty
+//                                      line is the end of input)
+//   ^U, ^K, ^W                         delete to the start, to the end, or
+//                                      the word before the cursor
+//   up/down ^P/^N                      step through the history
+//   ^R                                 search the history, newest first
+//   tab                                complete a command or file name
+//   ^C                                 abandon the line, ^L clears the screen
+// Bytes read past the end of a line are kept for the next one, so typed
+// ahead input goes to the shell rather than to the command being run.
+bool line_editing = false;
+struct termios cooked_termios;
+bool terminal_raw = false;
+
+enum EditorKey {
+    KEY_EOF = -1,
+    KEY_UP = 256,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_ESCAPE,
+    KEY_OTHER,      // an escape sequence we don't handle
+};
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define NO_HISTORY SIZE_MAX
+
+struct EditBuffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct LineEditor {
+    struct EditBuffer line;
+    size_t pos;                 // cursor, as an offset into line
+    size_t hist;                // history entry shown, or NO_HISTORY
+    struct EditBuffer saved;    // the line being typed while browsing history
+    bool searching;             // in a ^R search
+    bool search_failed;
+    struct EditBuffer query;
+    struct EditBuffer before_search;    // the line to go back to on ^G
+    long match;                 // history entry the search is at, or -1
+    bool tabbed;                // the last key was a tab
+    struct EditBuffer prompt;
+    struct EditBuffer out;      // terminal output, written once per update
+    bool shown;                 // the prompt and line are on the screen
+    char in[256];
+    size_t in_len;
+    size_t in_pos;
+};
+
+struct LineEditor editor;
+
+void buffer_reserve(struct EditBuffer *buf, size_t len) {
+    if (len <= buf->size) {
+        return;
+    }
+    buf->size = len > 2 * buf->size ? len : 2 * buf->size;
+    buf->data = realloc(buf->data, buf->size);
+    if (buf->data == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+}
+
+void buffer_set(struct EditBuffer *buf, const char *text, size_t len) {
+    buffer_reserve(buf, len + 1);
+    memcpy(buf->data, text, len);
+    buf->data[len] = '\0';
+    buf->len = len;
+}
+
+void buffer_append(struct EditBuffer *buf, const char *text, size_t len) {
+    buffer_reserve(buf, buf->len + len + 1);
+    memcpy(buf->data + buf->len, text, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// History is an append-only file ($WISH_HISTORY, or ~/.wish_history) of one
+// entry per line. At startup the file is only mapped, it is split into an
+// index of entries the first time the history is browsed or searched, so
+// starting the shell costs the same with a million entries as with none.
+// Lines entered are added to the index and appended to the file with one
+// write each.
+//
+// ^R searches the file's entries through a trigram index, built the first
+// time the history is searched: the entries are grouped in blocks of
+// HISTORY_BLOCK, and each trigram (hashed into one of TRIGRAM_BUCKETS) lists
+// the blocks it occurs in. A query of three or more characters can only
+// match in blocks listed under all of its trigrams, so only those are
+// scanned. Shorter queries, and the few entries added since startup, are
+// scanned directly.
+#define HISTORY_BLOCK 64
+#define TRIGRAM_BUCKETS 65536
+
+struct HistoryEntry {
+    const char *text;
+    size_t len;
+};
+
+struct History {
+    int fd;                     // the file, or -1
+    char *map;                  // the file as it was at startup
+    size_t map_size;
+    bool indexed;
+    struct HistoryEntry *old;   // entries of map, once indexed
+    size_t nold;
+    struct HistoryEntry *added; // entries added since startup
+    size_t nadded;
+    size_t added_size;
+    uint32_t *trigram_start;    // per bucket, offset of its list in trigram_blocks
+    uint32_t *trigram_blocks;   // block numbers of each bucket, ascending
+};
+
+struct History history = { .fd = -1 };
+
+void history_open() {
+    char *file = get_variable("WISH_HISTORY", strlen("WISH_HISTORY"));
+    char *home = get_variable("HOME", strlen("HOME"));
+    char *path = file;
+    if (file == NULL && home != NULL) {
+        path = concat(home, ".wish_history");
+    }
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (path != file) {
+        free(path);
+    }
+    struct stat st;
+    if (history.fd >= 0 && fstat(history.fd, &st) == 0 && st.st_size > 0) {
+        history.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+        if (history.map == MAP_FAILED) {
+            history.map = NULL;
+        } else {
+            history.map_size = st.st_size;
+        }
+    }
+}
+
+// split the mapped file into entries, skipping empty lines
+void history_index() {
+    if (history.indexed) {
+        return;
+    }
+    history.indexed = true;
+    char *end = history.map + history.map_size;
+    size_t count = 0;
+    for (char *p = history.map; p < end && (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        count++;
+    }
+    history.old = malloc((count + 1) * sizeof(struct HistoryEntry));
+    if (history.old == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    for (char *p = history.map; p < end;) {
+        char *newline = memchr(p, '\n', end - p);
+        size_t len = newline ? (size_t)(newline - p) : (size_t)(end - p);
+        if (len > 0) {
+            history.old[history.nold].text = p;
+            history.old[history.nold].len = len;
+            history.nold++;
+        }
+        p += len + 1;
+    }
+}
+
+size_t history_count() {
+    return history.nold + history.nadded;
+}
+
+struct HistoryEntry *history_get(size_t i) {
+    return i < history.nold ? &history.old[i] : &history.added[i - history.nold];
+}
+
+// the newest entry, without indexing the file for it
+bool history_last(struct HistoryEntry *last) {
+    if (history.nadded > 0) {
+        *last = history.added[history.nadded - 1];
+        return true;
+    }
+    size_t end = history.map_size;
+    while (end > 0 && history.map[end - 1] == '\n') {
+        end--;
+    }
+    if (end == 0) {
+        return false;
+    }
+    char *newline = memrchr(history.map, '\n', end);
+    last->text = newline ? newline + 1 : history.map;
+    last->len = history.map + end - last->text;
+    return true;
+}
+
+void history_add(const char *line, size_t len) {
+    struct HistoryEntry last;
+    size_t spaces = 0;
+    while (spaces < len && isspace((unsigned char)line[spaces])) {
+        spaces++;
+    }
+    if (spaces == len
+        || (history_last(&last) && last.len == len && memcmp(last.text, line, len) == 0)) {
+        return;
+    }
+    if (history.nadded == history.added_size) {
+        history.added_size = history.added_size ? 2 * history.added_size : 64;
+        history.added = realloc(history.added, history.added_size * sizeof(struct HistoryEntry));
+        if (history.added == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *copy = malloc(len);
+    if (copy == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, line, len);
+    history.added[history.nadded].text = copy;
+    history.added[history.nadded].len = len;
+    history.nadded++;
+
+    if (history.fd >= 0) {
+        // one write, so shells sharing the file don't interleave lines
+        struct iovec entry[2] = {{copy, len}, {"\n", 1}};
+        if (writev(history.fd, entry, 2) < 0) {
+            close(history.fd);
+            history.fd = -1;
+        }
+    }
+}
+
+uint32_t trigram_bucket(const char *p) {
+    uint32_t trigram = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+    return (trigram * 2654435761u) >> 16;
+}
+
+// list the blocks of the file's entries each trigram bucket occurs in: one
+// pass counts them, the next fills them in
+void history_index_trigrams() {
+    if (history.trigram_start != NULL) {
+        return;
+    }
+    uint32_t *start = calloc(TRIGRAM_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t *seen = calloc(TRIGRAM_BUCKETS, sizeof(uint32_t));   // last block + 1
+    uint32_t *blocks = NULL;
+    if (start == NULL || seen == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < history.nold; i++) {
+            uint32_t block = i / HISTORY_BLOCK;
+            struct HistoryEntry *entry = &history.old[i];
+            for (size_t j = 0; j + 3 <= entry->len; j++) {
+                uint32_t bucket = trigram_bucket(entry->text + j);
+                if (seen[bucket] == block + 1) {
+                    continue;
+                }
+                seen[bucket] = block + 1;
+                if (pass == 0) {
+                    start[bucket + 1]++;
+                } else {
+                    blocks[start[bucket]++] = block;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int b = 0; b < TRIGRAM_BUCKETS; b++) {
+                start[b + 1] += start[b];
+            }
+            blocks = malloc((start[TRIGRAM_BUCKETS] + 1) * sizeof(uint32_t));
+            if (blocks == NULL) {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+            memset(seen, 0, TRIGRAM_BUCKETS * sizeof(uint32_t));
+        }
+    }
+    // filling moved each start to the next bucket's
+    memmove(start + 1, start, TRIGRAM_BUCKETS * sizeof(uint32_t));
+    start[0] = 0;
+    free(seen);
+    history.trigram_start = start;
+    history.trigram_blocks = blocks;
+}
+
+bool bucket_has_block(uint32_t bucket, uint32_t block) {
+    uint32_t lo = history.trigram_start[bucket];
+    uint32_t hi = history.trigram_start[bucket + 1];
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (history.trigram_blocks[mid] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < history.trigram_start[bucket + 1] && history.trigram_blocks[lo] == block;
+}
+
+// the newest entry in [first, end) that contains query, or -1
+long history_scan(const char *query, size_t len, size_t first, size_t end) {
+    while (end-- > first) {
+        struct HistoryEntry *entry = history_get(end);
+        if (memmem(entry->text, entry->len, query, len) != NULL) {
+            return end;
+        }
+    }
+    return -1;
+}
+
+// the newest entry before entry 'before' that contains query, or -1
+long history_search(const char *query, size_t len, size_t before) {
+    history_index();
+    if (before > history.nold) {
+        long match = history_scan(query, len, history.nold, before);
+        if (match >= 0) {
+            return match;
+        }
+        before = history.nold;
+    }
+    if (len < 3) {
+        return history_scan(query, len, 0, before);
+    }
+
+    // walk the blocks of the query's rarest trigram, newest first, skipping
+    // those missing any of its other trigrams
+    history_index_trigrams();
+    uint32_t *start = history.trigram_start;
+    uint32_t rarest = trigram_bucket(query);
+    for (size_t j = 1; j + 3 <= len; j++) {
+        uint32_t bucket = trigram_bucket(query + j);
+        if (start[bucket + 1] - start[bucket] < start[rarest + 1] - start[rarest]) {
+            rarest = bucket;
+        }
+    }
+    for (uint32_t k = start[rarest + 1]; k-- > start[rarest];) {
+        uint32_t block = history.trigram_blocks[k];
+        size_t first = (size_t)block * HISTORY_BLOCK;
+        if (first >= before) {
+            continue;
+        }
+        bool candidate = true;
+        for (size_t j = 0; candidate && j + 3 <= len; j++) {
+            candidate = bucket_has_block(trigram_bucket(query + j), block);
+        }
+        size_t end = first + HISTORY_BLOCK < before ? first + HISTORY_BLOCK : before;
+        long match = candidate ? history_scan(query, len, first, end) : -1;
+        if (match >= 0) {
+            return match;
+        }
+    }
+    return -1;
+}
+
+void terminal_cooked() {
+    if (terminal_raw) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked_termios);
+        terminal_raw = false;
+    }
+}
+
+// keys are read one at a time without echo, and ^C, ^Z, ... are just keys;
+// output processing stays on so '\n' is still a new line
+void terminal_raw_mode() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &cooked_termios) != 0) {
+        return;
+    }
+    struct termios raw = cooked_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0) {
+        terminal_raw = true;
+    }
+}
+
+void init_editor() {
+    line_editing = true;
+    history_open();
+    atexit(terminal_cooked);
+}
+
+void editor_put(const char *text, size_t len) {
+    buffer_append(&editor.out, text, len);
+}
+
+void editor_flush() {
+    diag_flush();
+    write_all(STDERR_FILENO, editor.out.data, editor.out.len);
+    editor.out.len = 0;
+}
+
+void editor_beep() {
+    editor_put("\a", 1);
+}
+
+// draw the prompt and line, scrolled sideways to keep the cursor on screen
+void editor_redraw() {
+    buffer_set(&editor.prompt, "", 0);
+    if (editor.searching) {
+        char *kind = editor.search_failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+        buffer_append(&editor.prompt, kind, strlen(kind));
+        buffer_append(&editor.prompt, editor.query.data, editor.query.len);
+        buffer_append(&editor.prompt, "': ", 3);
+    } else {
+        buffer_append(&editor.prompt, ps1, strlen(ps1));
+    }
+
+    struct winsize ws;
+    size_t cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t room = cols > editor.prompt.len + 1 ? cols - editor.prompt.len - 1 : 1;
+    size_t start = editor.pos > room ? editor.pos - room : 0;
+    size_t shown = editor.line.len - start < room ? editor.line.len - start : room;
+    editor_put("\r", 1);
+    editor_put(editor.prompt.data, editor.prompt.len);
+    editor_put(editor.line.data + start, shown);
+    editor_put("\x1b[K\r", 4);
+    size_t column = editor.prompt.len + editor.pos - start;
+    if (column > 0) {
+        char move[32];
+        editor_put(move, snprintf(move, sizeof(move), "\x1b[%zuC", column));
+    }
+    editor_flush();
+    editor.shown = true;
+}
+
+// redraw after a key, but only once pasted (or typed ahead) keys are done
+void editor_update() {
+    if (editor.in_pos == editor.in_len) {
+        editor_redraw();
+    }
+}
+
+// clear the line being edited off the screen, e.g. to report a job
+void editor_hide() {
+    if (line_editing && editor.shown) {
+        editor_put("\r\x1b[K", 4);
+        editor_flush();
+        editor.shown = false;
+    }
+}
+
+// the next byte of input, or -1 at the end of input
+int editor_byte() {
+    if (editor.in_pos == editor.in_len) {
+        // background jobs can finish (and say so) while we wait
+        reported_done = false;
+        while (!wait_event(true)) {
+            if (reported_done) {
+                editor_redraw();
+                reported_done = false;
+            }
+        }
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, editor.in, sizeof(editor.in))) < 0 && errno == EINTR);
+        if (n <= 0) {
+            return KEY_EOF;
+        }
+        editor.in_len = n;
+        editor.in_pos = 0;
+    }
+    return (unsigned char)editor.in[editor.in_pos++];
+}
+
+// the next key, with escape sequences (ESC [ ... or ESC O ...) decoded
+int editor_key() {
+    int c = editor_byte();
+    if (c != '\x1b') {
+        return c;
+    }
+    // a terminal sends a sequence in one go, an escape on its own is a key
+    if (editor.in_pos == editor.in_len) {
+        return KEY_ESCAPE;
+    }
+    c = editor_byte();
+    if (c != '[' && c != 'O') {
+        return KEY_OTHER;
+    }
+    // parameters (digits and ';') then a final byte
+    int number = 0;
+    while ((c = editor_byte()) != KEY_EOF && (isdigit(c) || c == ';')) {
+        number = c == ';' ? 0 : number * 10 + c - '0';
+    }
+    switch (c) {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    case '~':
+        return number == 1 || number == 7 ? KEY_HOME
+               : number == 4 || number == 8 ? KEY_END
+               : number == 3 ? KEY_DELETE : KEY_OTHER;
+    }
+    return KEY_OTHER;
+}
+
+void editor_insert(const char *text, size_t len) {
+    struct EditBuffer *line = &editor.line;
+    buffer_reserve(line, line->len + len + 1);
+    memmove(line->data + editor.pos + len, line->data + editor.pos, line->len - editor.pos);
+    memcpy(line->data + editor.pos, text, len);
+    line->len += len;
+    editor.pos += len;
+}
+
+// delete the len bytes before the cursor
+void editor_delete(size_t len) {
+    struct EditBuffer *line = &editor.line;
+    memmove(line->data + editor.pos - len, line->data + editor.pos, line->len - editor.pos);
+    line->len -= len;
+    editor.pos -= len;
+}
+
+void editor_show_entry(size_t i) {
+    struct HistoryEntry *entry = history_get(i);
+    buffer_set(&editor.line, entry->text, entry->len);
+    editor.pos = entry->len;
+}
+
+void editor_history_step(int key) {
+    history_index();
+    if (key == KEY_UP && editor.hist != 0 && history_count() > 0) {
+        if (editor.hist == NO_HISTORY) {
+            buffer_set(&editor.saved, editor.line.data, editor.line.len);
+            editor.hist = history_count();
+        }
+        editor_show_entry(--editor.hist);
+    } else if (key == KEY_DOWN && editor.hist != NO_HISTORY) {
+        if (++editor.hist < history_count()) {
+            editor_show_entry(editor.hist);
+        } else {
+            buffer_set(&editor.line, editor.saved.data, editor.saved.len);
+            editor.pos = editor.line.len;
+            editor.hist = NO_HISTORY;
+        }
+    } else {
+        editor_beep();
+    }
+}
+
+// look for the query in entries older than before, showing the match with
+// the cursor on it
+void editor_search(size_t before) {
+    long match = history_search(editor.query.data, editor.query.len, before);
+    editor.search_failed = match < 0;
+    if (match < 0) {
+        editor_beep();
+        return;
+    }
+    editor.match = match;
+    editor_show_entry(match);
+    struct HistoryEntry *entry = history_get(match);
+    editor.pos = (char *)memmem(entry->text, entry->len, editor.query.data, editor.query.len)
+                 - entry->text;
+}
+
+// Handle a key during a ^R search. Each typed character narrows the
+// search, which carries on from the current match since no newer entry can
+// match a longer query. Returns false if the key ends the search and should
+// also be handled as a normal key.
+bool editor_search_key(int key) {
+    if (key == KEY_CTRL('r')) {
+        if (editor.query.len > 0) {
+            editor_search(editor.match >= 0 ? (size_t)editor.match : history_count());
+        }
+    } else if (key == 127 || key == KEY_CTRL('h')) {
+        if (editor.query.len > 0) {
+            editor.query.len--;
+        }
+        editor.match = -1;
+        editor.search_failed = false;
+        if (editor.query.len > 0) {
+            editor_search(history_count());
+        } else {
+            buffer_set(&editor.line, editor.before_search.data, editor.before_search.len);
+            editor.pos = editor.line.len;
+        }
+    } else if (key >= ' ' && key < 256 && key != 127) {
+        char c = key;
+        buffer_append(&editor.query, &c, 1);
+        if (editor.search_failed) {
+            // a longer query can't match either
+            editor_beep();
+        } else {
+            editor_search(editor.match >= 0 ? (size_t)editor.match + 1 : history_count());
+        }
+    } else if (key == KEY_CTRL('g') || key == KEY_CTRL('c') || key == KEY_ESCAPE) {
+        buffer_set(&editor.line, editor.before_search.data, editor.before_search.len);
+        editor.pos = editor.line.len;
+        editor.searching = false;
+    } else {
+        editor.searching = false;
+        editor.hist = NO_HISTORY;
+        return false;
+    }
+    editor_update();
+    return true;
+}
+
+// Executables in the PATH directories, for completing commands. Like the
+// command hash they are found once and kept, and listed again when PATH is
+// changed or one of its directories is modified.
+struct PathNames {
+    char **names;               // sorted, without duplicates
+    size_t count;
+    char *path;                 // the PATH they were listed from
+    struct timespec *mtimes;    // of each directory in path
+    int ndirs;
+};
+
+struct PathNames path_names;
+
+// the modification times of the PATH directories, up to max of them
+int path_dir_mtimes(struct timespec *mtimes, int max) {
+    char *path = strdup(PATH);
+    int ndirs = 0;
+    if (path == NULL) {
+        return 0;
+    }
+    for (char *dir = strtok(path, ":"); dir != NULL; dir = strtok(NULL, ":"), ndirs++) {
+        struct stat st;
+        if (ndirs < max) {
+            mtimes[ndirs] = stat(dir, &st) == 0 ? st.st_mtim : (struct timespec){0};
+        }
+    }
+    free(path);
+    return ndirs;
+}
+
+bool path_names_current() {
+    if (path_names.path == NULL || strcmp(path_names.path, PATH) != 0) {
+        return false;
+    }
+    struct timespec mtimes[path_names.ndirs + 1];
+    if (path_dir_mtimes(mtimes, path_names.ndirs + 1) != path_names.ndirs) {
+        return false;
+    }
+    for (int i = 0; i < path_names.ndirs; i++) {
+        if (mtimes[i].tv_sec != path_names.mtimes[i].tv_sec
+            || mtimes[i].tv_nsec != path_names.mtimes[i].tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void list_path_names() {
+    for (size_t i = 0; i < path_names.count; i++) {
+        free(path_names.names[i]);
+    }
+    free(path_names.path);
+    free(path_names.mtimes);
+    path_names.count = 0;
+    path_names.path = strdup(PATH);
+    path_names.ndirs = path_dir_mtimes(NULL, 0);
+    path_names.mtimes = malloc((path_names.ndirs + 1) * sizeof(struct timespec));
+    if (path_names.path == NULL || path_names.mtimes == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    path_dir_mtimes(path_names.mtimes, path_names.ndirs);
+
+    size_t size = 0;
+    char *path = strdup(PATH);
+    for (char *dir = strtok(path, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            struct stat st;
+            if (entry->d_name[0] == '.' || fstatat(dirfd(d), entry->d_name, &st, 0) != 0
+                || !S_ISREG(st.st_mode) || !(st.st_mode & 0111)) {
+                continue;
+            }
+            if (path_names.count == size) {
+                size = size ? 2 * size : 256;
+                path_names.names = realloc(path_names.names, size * sizeof(char*));
+                if (path_names.names == NULL) {
+                    print_error();
+                    exit(EXIT_FAILURE);
+                }
+            }
+            path_names.names[path_names.count++] = strdup(entry->d_name);
+        }
+        closedir(d);
+    }
+    free(path);
+
+    qsort(path_names.names, path_names.count, sizeof(char*), compare_strings);
+    size_t unique = 0;
+    for (size_t i = 0; i < path_names.count; i++) {
+        if (unique > 0 && strcmp(path_names.names[unique - 1], path_names.names[i]) == 0) {
+            free(path_names.names[i]);
+        } else {
+            path_names.names[unique++] = path_names.names[i];
+        }
+    }
+    path_names.count = unique;
+}
+
+// Completion candidates are collected in line_arena
+struct Completions {
+    char **names;
+    size_t count;
+    size_t size;
+};
+
+void add_completion(struct Completions *found, const char *name, bool dir) {
+    if (found->count == found->size) {
+        found->size = found->size ? 2 * found->size : 32;
+        char **names = arena_alloc(&line_arena, found->size * sizeof(char*));
+        memcpy(names, found->names, found->count * sizeof(char*));
+        found->names = names;
+    }
+    found->names[found->count++] = arena_concat(name, strlen(name), "/", dir ? 1 : 0);
+}
+
+void complete_command(struct Completions *found, const char *prefix, size_t len) {
+    for (int i = 0; i < num_of_builtins(); i++) {
+        if (strncmp(builtin_options[i], prefix, len) == 0) {
+            add_completion(found, builtin_options[i], false);
+        }
+    }
+    if (!path_names_current()) {
+        list_path_names();
+    }
+    // the names starting with prefix are together in the sorted list
+    size_t low = 0;
+    size_t high = path_names.count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strncmp(path_names.names[mid], prefix, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < path_names.count && strncmp(path_names.names[low], prefix, len) == 0; low++) {
+        add_completion(found, path_names.names[low], false);
+    }
+}
+
+// names in the directory part of word that start with the rest of it
+void complete_file(struct Completions *found, const char *word, size_t len) {
+    const char *slash = memrchr(word, '/', len);
+    const char *prefix = slash ? slash + 1 : word;
+    size_t prefix_len = word + len - prefix;
+    char *dir = slash == NULL ? "." : slash == word ? "/" : arena_concat(word, slash - word, "", 0);
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+            || (name[0] == '.' && (prefix_len == 0 || prefix[0] != '.'))
+            || strncmp(name, prefix, prefix_len) != 0) {
+            continue;
+        }
+        struct stat st;
+        bool is_dir = entry->d_type == DT_DIR
+                      || ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+                          && fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        add_completion(found, name, is_dir);
+    }
+    closedir(d);
+    qsort(found->names, found->count, sizeof(char*), compare_strings);
+}
+
+// show every candidate under the line, then the line again
+void list_completions(struct Completions *found) {
+    struct winsize ws;
+    size_t cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    editor_put("\n", 1);
+    if (found->count > 100) {
+        char count[64];
+        editor_put(count, snprintf(count, sizeof(count), "%zu possibilities\n", found->count));
+    } else {
+        size_t column = 0;
+        for (size_t i = 0; i < found->count; i++) {
+            size_t len = strlen(found->names[i]);
+            if (column > 0 && column + len + 2 > cols) {
+                editor_put("\n", 1);
+                column = 0;
+            }
+            editor_put(found->names[i], len);
+            editor_put("  ", 2);
+            column += len + 2;
+        }
+        editor_put("\n", 1);
+    }
+    editor_flush();
+}
+
+// Complete the word before the cursor: a command at the start of a
+// pipeline, otherwise a file name. Completes as far as the candidates
+// agree, and a second tab lists them.
+void editor_complete() {
+    char *line = editor.line.data;
+    size_t start = editor.pos;
+    while (start > 0 && !isspace((unsigned char)line[start - 1])
+           && strchr("|&;<>", line[start - 1]) == NULL) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && isspace((unsigned char)line[before - 1])) {
+        before--;
+    }
+    const char *word = line + start;
+    size_t len = editor.pos - start;
+    struct Completions found = {0};
+    if ((before == 0 || strchr("|&;", line[before - 1]) != NULL) && memchr(word, '/', len) == NULL) {
+        complete_command(&found, word, len);
+    } else {
+        complete_file(&found, word, len);
+    }
+    if (found.count == 0) {
+        editor_beep();
+        return;
+    }
+
+    // the typed part of the name, after any directory
+    const char *slash = memrchr(word, '/', len);
+    size_t typed = slash ? (size_t)(word + len - slash - 1) : len;
+    size_t common = strlen(found.names[0]);
+    for (size_t i = 1; i < found.count; i++) {
+        size_t j = 0;
+        while (j < common && found.names[i][j] == found.names[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+    if (common > typed) {
+        editor_insert(found.names[0] + typed, common - typed);
+    }
+    if (found.count == 1 && found.names[0][common - 1] != '/') {
+        editor_insert(" ", 1);
+    } else if (found.count > 1 && common == typed) {
+        if (editor.tabbed) {
+            editor_hide();
+            list_completions(&found);
+        } else {
+            editor_beep();
+        }
+    }
+}
+
+// Read and edit a line, returning it (and its length in *len) or NULL at
+// the end of input. The line is added to the history.
+char *editor_read_line(size_t *len) {
+    editor.line.len = 0;
+    editor.pos = 0;
+    editor.hist = NO_HISTORY;
+    editor.searching = false;
+    editor.tabbed = false;
+    buffer_reserve(&editor.line, 1);
+    terminal_raw_mode();
+    editor_redraw();
+    while (true) {
+        int key = editor_key();
+        if (editor.searching && editor_search_key(key)) {
+            continue;
+        }
+        bool tab = false;
+        switch (key) {
+        case '\r':
+        case '\n':
+        case KEY_EOF:
+            if (key == KEY_EOF && editor.line.len == 0) {
+                editor_hide();
+                terminal_cooked();
+                return NULL;
+            }
+            editor.pos = editor.line.len;
+            editor_redraw();
+            editor_put("\n", 1);
+            editor_flush();
+            editor.shown = false;
+            terminal_cooked();
+            editor.line.data[editor.line.len] = '\0';
+            history_add(editor.line.data, editor.line.len);
+            *len = editor.line.len;
+            return editor.line.data;
+        case KEY_CTRL('d'):
+            if (editor.line.len == 0) {
+                editor_hide();
+                terminal_cooked();
+                return NULL;
+            }
+            // fall through
+        case KEY_DELETE:
+            if (editor.pos < editor.line.len) {
+                editor.pos++;
+                editor_delete(1);
+            }
+            break;
+        case 127:
+        case KEY_CTRL('h'):
+            if (editor.pos > 0) {
+                editor_delete(1);
+            }
+            break;
+        case KEY_CTRL('u'):
+            editor_delete(editor.pos);
+            break;
+        case KEY_CTRL('k'):
+            editor.line.len = editor.pos;
+            break;
+        case KEY_CTRL('w'): {
+            size_t start = editor.pos;
+            while (start > 0 && isspace((unsigned char)editor.line.data[start - 1])) {
+                start--;
+            }
+            while (start > 0 && !isspace((unsigned char)editor.line.data[start - 1])) {
+                start--;
+            }
+            editor_delete(editor.pos - start);
+            break;
+        }
+        case KEY_CTRL('a'):
+        case KEY_HOME:
+            editor.pos = 0;
+            break;
+        case KEY_CTRL('e'):
+        case KEY_END:
+            editor.pos = editor.line.len;
+            break;
+        case KEY_CTRL('b'):
+        case KEY_LEFT:
+            if (editor.pos > 0) {
+                editor.pos--;
+            }
+            break;
+        case KEY_CTRL('f'):
+        case KEY_RIGHT:
+            if (editor.pos < editor.line.len) {
+                editor.pos++;
+            }
+            break;
+        case KEY_CTRL('p'):
+        case KEY_UP:
+            editor_history_step(KEY_UP);
+            break;
+        case KEY_CTRL('n'):
+        case KEY_DOWN:
+            editor_history_step(KEY_DOWN);
+            break;
+        case KEY_CTRL('r'):
+            history_index();
+            editor.searching = true;
+            editor.search_failed = false;
+            editor.match = -1;
+            buffer_set(&editor.query, "", 0);
+            buffer_set(&editor.before_search, editor.line.data, editor.line.len);
+            break;
+        case '\t':
+            tab = true;
+            editor_complete();
+            break;
+        case KEY_CTRL('c'):
+            editor.pos = editor.line.len;
+            editor_redraw();
+            editor_put("^C\n", 3);
+            editor.line.len = 0;
+            editor.pos = 0;
+            editor.hist = NO_HISTORY;
+            break;
+        case KEY_CTRL('l'):
+            editor_put("\x1b[H\x1b[2J", 7);
+            break;
+        default:
+            if (key >= ' ' && key < 256 && key != 127) {
+                char c = key;
+                editor_insert(&c, 1);
+            }
+        }
+        editor.tabbed = tab;
+        editor_update();
+    }
+}
+
+// Lines come either from text input, tokenized as they are read, or from a
+// compiled script's image
+struct LineSource {
+    struct InputSource *input;
+    bool interactive;
+    struct CompiledImage *image;
+    uint32_t next;              // next line of image
+};
+
+// Put the next line into line_arena, *cmd_list is NULL if it has no
+// commands. Returns false at the end of input.
+bool next_line(struct LineSource *source, struct Command **cmd_list) {
+    arena_reset(&line_arena);
+    if (source->image != NULL) {
+        struct CompiledImage *image = source->image;
+        if (source->next == image->header->nlines) {
+            return false;
+        }
+        struct CompiledLine *line = &image->lines[source->next++];
+        if (line->first > image->header->ncommands
+            || line->count > image->header->ncommands - line->first) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        line_number = line->number;
+        for (uint32_t j = 0; j < line->errors; j++) {
+            print_error();
+        }
+        *cmd_list = load_compiled_line(image, line);
+        return true;
+    }
+
+    size_t len;
+    char *line;
+    if (source->interactive && line_editing) {
+        line = editor_read_line(&len);
+    } else {
+        if (source->interactive) {
+            // background jobs can finish (and say so) while we wait for a line
+            print_ps1();
+            reported_done = false;
+            while (!wait_event(true)) {
+                if (reported_done) {
+                    print_ps1();
+                    reported_done = false;
+                }
+            }
+        }
+        line = wish_read_line(source->input, &len);
+    }
+    if (line == NULL) {
+        return false;
+    }
+    line_number++;
+    *cmd_list = wish_tokenize_line(line, len);
+    return true;
+}
+
+// Control flow: if/else/fi, while/done and for NAME in words/done (with
+// break and continue) are compiled into a small bytecode program, which is
+// run once the block is complete. Each line of the block is tokenized once
+// when it is compiled, running it again only costs copying its nodes and
+// expanding its variables and globs.
+enum Opcode {
+    OP_RUN,         // run cmd as a line
+    OP_TEST,        // carry on if the last status ($?) is 0, else jump
+    OP_JUMP,
+    OP_FOR_INIT,    // expand cmd's args as the words of loop
+    OP_FOR_NEXT     // set var to the loop's next word, or jump when done
+};
+
+struct Instruction {
+    enum Opcode op;
+    int target;                 // jump target
+    struct Command *cmd;
+    bool expand;                // cmd has a '$' or glob to expand
+    int loop;                   // for loops, index into Program.loops
+    char *var;
+    unsigned long line;         // line_number the instruction came from
+};
+
+struct ForLoop {
+    char **words;
+    int count;
+    int next;
+    struct Arena arena;         // the expanded words
+};
+
+struct Program {
+    struct Instruction *code;
+    int count;
+    int size;
+    struct ForLoop *loops;
+    int nloops;
+    int loops_size;
+    struct Arena arena;         // commands of the block, outliving their lines
+};
+
+struct Program program;
+
+// the loop being compiled, for break and continue
+struct LoopContext {
+    int top;                    // where continue jumps to
+    int *breaks;                // jumps to patch with the loop's end
+    int nbreaks;
+    struct LoopContext *outer;
+};
+
+bool word_expands(const char *word) {
+    return strchr(word, '$') != NULL || has_glob(word, strlen(word));
+}
+
+// whether expand_group could change any word of line
+bool line_expands(struct Command *line) {
+    for (; line != NULL; line = line->next) {
+        for (struct Command *cmd = line; cmd != NULL; cmd = cmd->pipe) {
+            for (int i = 0; i < cmd->argc; i++) {
+                if (word_expands(cmd->args[i])) {
+                    return true;
+                }
+            }
+            for (int i = 0; i < cmd->nredirects; i++) {
+                if (word_expands(cmd->redirects[i].file)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+int emit(enum Opcode op, struct Command *cmd) {
+    if (program.count == program.size) {
+        program.size = program.size ? 2 * program.size : 64;
+        program.code = realloc(program.code, program.size * sizeof(struct Instruction));
+        if (program.code == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct Instruction *ins = &program.code[program.count];
+    ins->op = op;
+    ins->target = -1;
+    ins->cmd = cmd;
+    ins->expand = line_expands(cmd);
+    ins->loop = -1;
+    ins->var = NULL;
+    ins->line = line_number;
+    return program.count++;
+}
+
+// copy a tokenized line into the program's arena
+struct Command *keep_line(struct Command *line) {
+    struct Command *head = NULL;
+    struct Command *tail = NULL;
+    for (; line != NULL; line = line->next) {
+        struct Command *copy = copy_pipeline(&program.arena, line);
+        if (head == NULL) {
+            head = copy;
+        } else {
+            tail->next = copy;
+        }
+        tail = copy;
+    }
+    return head;
+}
+
+// the line after a keyword, e.g. the condition of 'if cond args'
+struct Command *after_keyword(struct Command *cmd) {
+    struct Command *rest = arena_alloc(&line_arena, sizeof(struct Command));
+    *rest = *cmd;
+    rest->args++;
+    rest->argc--;
+    rest->cmd = rest->args[0];
+    rest->exe = NULL;
+    return rest;
+}
+
+bool is_keyword(struct Command *cmd, char *keyword) {
+    return cmd != NULL && strcmp(cmd->cmd, keyword) == 0;
+}
+
+bool starts_block(struct Command *cmd) {
+    return is_keyword(cmd, "if") || is_keyword(cmd, "while") || is_keyword(cmd, "for");
+}
+
+bool compile_statement(struct LineSource *source, struct Command *cmd, struct LoopContext *loop);
+
+// Compile lines up to one that is one of the terminators (else, fi, done)
+// and return it, or NULL at the end of input or on an error
+struct Command *compile_body(struct LineSource *source, char **terminators, struct LoopContext *loop) {
+    struct Command *cmd;
+    while (next_line(source, &cmd)) {
+        if (cmd == NULL) {
+            continue;
+        }
+        for (int i = 0; terminators[i] != NULL; i++) {
+            if (is_keyword(cmd, terminators[i])) {
+                return cmd->argc == 1 && cmd->next == NULL && cmd->pipe == NULL ? cmd : NULL;
+            }
+        }
+        if (!compile_statement(source, cmd, loop)) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void patch_breaks(struct LoopContext *loop) {
+    for (int i = 0; i < loop->nbreaks; i++) {
+        program.code[loop->breaks[i]].target = program.count;
+    }
+    free(loop->breaks);
+}
+
+void add_break(struct LoopContext *loop, int jump) {
+    loop->breaks = realloc(loop->breaks, (loop->nbreaks + 1) * sizeof(int));
+    if (loop->breaks == NULL) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+    loop->breaks[loop->nbreaks++] = jump;
+}
+
+// compile one line, and the rest of its block if it starts one
+bool compile_statement(struct LineSource *source, struct Command *cmd, struct LoopContext *loop) {
+    bool single = cmd->next == NULL && cmd->pipe == NULL;
+    if (is_keyword(cmd, "if") || is_keyword(cmd, "while")) {
+        if (cmd->argc < 2) {
+            return false;
+        }
+        bool is_while = is_keyword(cmd, "while");
+        struct LoopContext inner = { program.count, NULL, 0, loop };
+        emit(OP_RUN, keep_line(after_keyword(cmd)));
+        int test = emit(OP_TEST, NULL);
+        char *if_end[] = {"else", "fi", NULL};
+        char *while_end[] = {"done", NULL};
+        struct Command *end = compile_body(source, is_while ? while_end : if_end,
+                                           is_while ? &inner : loop);
+        if (end == NULL) {
+            return false;
+        }
+        if (is_while) {
+            program.code[emit(OP_JUMP, NULL)].target = inner.top;
+            program.code[test].target = program.count;
+            patch_breaks(&inner);
+        } else if (is_keyword(end, "else")) {
+            int jump = emit(OP_JUMP, NULL);
+            program.code[test].target = program.count;
+            char *else_end[] = {"fi", NULL};
+            if (compile_body(source, else_end, loop) == NULL) {
+                return false;
+            }
+            program.code[jump].target = program.count;
+        } else {
+            program.code[test].target = program.count;
+        }
+        return true;
+    }
+
+    if (is_keyword(cmd, "for")) {
+        if (!single || cmd->argc < 3 || strcmp(cmd->args[2], "in") != 0
+            || name_length(cmd->args[1]) != strlen(cmd->args[1])) {
+            return false;
+        }
+        // the words are the args of a command named 'in'
+        int init = emit(OP_FOR_INIT, keep_line(after_keyword(after_keyword(cmd))));
+        program.code[init].loop = program.nloops++;
+        struct LoopContext inner = { program.count, NULL, 0, loop };
+        int next = emit(OP_FOR_NEXT, NULL);
+        program.code[next].loop = program.code[init].loop;
+        program.code[next].var = arena_strdup(&program.arena, cmd->args[1]);
+        char *for_end[] = {"done", NULL};
+        if (compile_body(source, for_end, &inner) == NULL) {
+            return false;
+        }
+        program.code[emit(OP_JUMP, NULL)].target = inner.top;
+        program.code[next].target = program.count;
+        patch_breaks(&inner);
+        return true;
+    }
+
+    if (is_keyword(cmd, "break") || is_keyword(cmd, "continue")) {
+        if (!single || cmd->argc != 1 || loop == NULL) {
+            return false;
+        }
+        int jump = emit(OP_JUMP, NULL);
+        if (is_keyword(cmd, "break")) {
+            add_break(loop, jump);
+        } else {
+            program.code[jump].target = loop->top;
+        }
+        return true;
+    }
+
+    emit(OP_RUN, keep_line(cmd));
+    return true;
+}
+
+// make a copy of a kept line to expand and run, the strings are shared
+struct Command *instantiate(struct Command *line) {
+    struct Command *head = NULL;
+    struct Command *pipe_tail = NULL;
+    struct Command *next_tail = NULL;
+    for (; line != NULL; line = line->next) {
+        for (struct Command *cmd = line; cmd != NULL; cmd = cmd->pipe) {
+            struct Command *node = arena_alloc(&line_arena, sizeof(struct Command));
+            *node = *cmd;
+            node->args = arena_alloc(&line_arena, (cmd->argc + 1) * sizeof(char*));
+            memcpy(node->args, cmd->args, (cmd->argc + 1) * sizeof(char*));
+            node->pipe = NULL;
+            node->next = NULL;
+            if (cmd == line) {
+                if (head == NULL) {
+                    head = node;
+                } else {
+                    next_tail->next = node;
+                }
+                next_tail = node;
+            } else {
+                pipe_tail->pipe = node;
+            }
+            pipe_tail = node;
+        }
+    }
+    return head;
+}
+
+// the interpreter loop
+void run_program() {
+    int pc = 0;
+    while (pc < program.count) {
+        struct Instruction *ins = &program.code[pc];
+        struct ForLoop *loop = ins->loop >= 0 ? &program.loops[ins->loop] : NULL;
+        switch (ins->op) {
+        case OP_RUN:
+            arena_reset(&line_arena);
+            line_number = ins->line;
+            if (ins->cmd != NULL && !ins->expand) {
+                // nothing to expand, and wish_execute leaves the line as is
+                wish_execute(ins->cmd, false);
+            } else if (ins->cmd != NULL) {
+                wish_execute(instantiate(ins->cmd), true);
+            } else {
+                last_status = EXIT_FAILURE;
+            }
+            pc++;
+            break;
+        case OP_TEST:
+            wait_foreground_jobs();
+            pc = last_status == 0 ? pc + 1 : ins->target;
+            break;
+        case OP_JUMP:
+            pc = ins->target;
+            break;
+        case OP_FOR_INIT: {
+            arena_reset(&line_arena);
+            struct Command *words = instantiate(ins->cmd);
+            expand_group(words);
+            arena_reset(&loop->arena);
+            loop->count = words->argc - 1;
+            loop->next = 0;
+            loop->words = arena_alloc(&loop->arena, (loop->count + 1) * sizeof(char*));
+            for (int i = 0; i < loop->count; i++) {
+                loop->words[i] = arena_strdup(&loop->arena, words->args[i + 1]);
+            }
+            pc++;
+            break;
+        }
+        case OP_FOR_NEXT:
+            if (loop->next == loop->count) {
+                pc = ins->target;
+                break;
+            }
+            arena_reset(&line_arena);
+            char *word = loop->words[loop->next++];
+            size_t len = strlen(ins->var);
+            size_t word_len = strlen(word);
+            char *entry = arena_alloc(&line_arena, len + word_len + 2);
+            memcpy(entry, ins->var, len);
+            entry[len] = '=';
+            memcpy(entry + len + 1, word, word_len + 1);
+            set_variable(entry, false);
+            pc++;
+            break;
+        }
+    }
+}
+
+// compile the block cmd starts and run it
+void run_block(struct LineSource *source, struct Command *cmd) {
+    program.count = 0;
+    program.nloops = 0;
+    arena_reset(&program.arena);
+    bool ok = compile_statement(source, cmd, NULL);
+
+    // loop states (and their arenas) are kept for the next block
+    if (program.nloops > program.loops_size) {
+        program.loops = realloc(program.loops, program.nloops * sizeof(struct ForLoop));
+        if (program.loops == NULL) {
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+        memset(&program.loops[program.loops_size], 0,
+               (program.nloops - program.loops_size) * sizeof(struct ForLoop));
+        program.loops_size = program.nloops;
+    }
+    if (!ok) {
+        // unterminated or malformed block
+        print_error();
+        last_status = EXIT_FAILURE;
+    } else if (!parse_only) {
+        run_program();
+    }
+}
+
+// run every line, and block, from source
+void run_lines(struct LineSource *source) {
+    struct Command *cmd_list;
+    while (next_line(source, &cmd_list)) {
+        if (cmd_list == NULL) {
+            continue;
+        }
+        if (starts_block(cmd_list)) {
+            run_block(source, cmd_list);
+        } else if (!parse_only) {
+            wish_execute(cmd_list, true);
+        }
+    }
+}
+
+// --compile source -o output: compile source instead of running anything
+char *compile_source = NULL;
+char *compile_output = NULL;
+
+// parse leading options, then shift them off so argv[1] is the batch file
+void parse_options(int *argc, char **argv[]) {
+    static struct option long_options[] = {
+        {"compile", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long(*argc, *argv, "+aej:no:pr:s:t:Tz", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            // -a lets lines run asynchronously, see async_mode
+            async_mode = true;
+            break;
+        case 'e':
+            // -e edits interactive lines even when stdin isn't a terminal
+            line_editing = true;
+            break;
+        case 'j':
+            // -j N runs at most N jobs of a line at once
+            max_jobs = atoi(optarg);
+            if (max_jobs < 1) {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            compile_source = optarg;
+            break;
+        case 'n':
+            // -n reads and parses commands without running them
+            parse_only = true;
+            break;
+        case 'o':
+            // -o file is where --compile writes the compiled script
+            compile_output = optarg;
+            break;
+        case 'p':
+            // -p runs echo, true, cat, ... as processes, see utility_options
+            utilities_in_process = false;
+            break;
+        case 'r':
+            // -r mmap|stdio selects how batch files are read
+            if (strcmp(optarg, "mmap") == 0) {
+                input_reader = READ_MMAP;
+            } else if (strcmp(optarg, "stdio") == 0) {
+                input_reader = READ_STDIO;
+            } else {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            // -s spawn|fork selects the process creation backend
+            if (strcmp(optarg, "fork") == 0) {
+                spawn_backend = SPAWN_FORK;
+            } else if (strcmp(optarg, "spawn") == 0) {
+#ifdef _POSIX_SPAWN
+                spawn_backend = SPAWN_POSIX;
+#endif
+            } else {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't': {
+            // -t file writes per-command times and resource usage to file
+            job_trace = fopen(optarg, "we");
+            if (job_trace == NULL) {
+                print_error();
+                exit(EXIT_FAILURE);
+            }
+            char *ext = strrchr(optarg, '.');
+            trace_json = ext && (strcmp(ext, ".json") == 0 || strcmp(ext, ".jsonl") == 0);
+            trace_header();
+            break;
+        }
+        case 'T':
+            // -T reports the times of every pipeline on stderr
+            time_all = true;
+            break;
+        case 'z':
+            // -z runs commands from zygotes, see zygote_mode
+            zygote_mode = true;
+            break;
+        default:
+            print_error();
+            exit(EXIT_FAILURE);
+        }
+    }
+    *argc -= optind - 1;
+    *argv += optind - 1;
+    if ((compile_source == NULL) != (compile_output == NULL)) {
+        print_error();
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    clock_gettime(CLOCK_MONOTONIC, &shell_start);
+    atexit(diag_flush);
+    init_variables();
+    parse_options(&argc, &argv);
+    if (compile_source != NULL) {
+        compile_script(compile_source, compile_output);
+        exit(EXIT_SUCCESS);
+    }
+    if (max_jobs == 0) {
+        // one job per CPU, but always allow '&' to run things side by side
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_jobs = cpus > 2 ? cpus : 2;
+    }
+    init_jobs();
+    init_events(is_interactive_mode(argc));
+    report_jobs = is_interactive_mode(argc);
+    if (zygote_mode) {
+        init_zygotes();
+    }
+
+    // descriptors we inherited shouldn't leak into every child, and all the
+    // ones we open ourselves are O_CLOEXEC
+    close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+
+    // ensure proper arguments passed
+    validate_argv(argc, argv);
+
+    if (is_interactive_mode(argc)
+        && (line_editing || (isatty(STDIN_FILENO) && isatty(STDERR_FILENO)))) {
+        init_editor();
+    }
+
+    struct InputSource input = {0};
+    struct CompiledImage image;
+    struct LineSource source = { .input = &input, .interactive = is_interactive_mode(argc) };
+    if (argc == 2 && is_compiled_script(argv[1])) {
+        // already parsed, run it from its image
+        image = map_compiled_script(argv[1]);
+        source.image = &image;
+    } else {
+        input = open_input(argc == 2 ? argv[1] : NULL);
+    }
+
+    // run command loop
+    run_lines(&source);
+
+    // end of input, let any async jobs finish first
+    wait_all_jobs();
+    close_input(&input);
+    exit(EXIT_SUCCESS);
 }
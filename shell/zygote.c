@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "dlfcn.h"
+#include "fcntl.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/wait.h"
+#include "zygote.h"
+
+// Preloaded into commands run by 'wish -z', see zygote.h
+
+typedef int (*main_func)(int, char **, char **);
+typedef int (*start_main_func)(main_func, int, char **, void (*)(void),
+                               void (*)(void), void (*)(void), void *);
+
+main_func real_main;
+
+// receive one request into buf, returning its length (0 when wish is gone)
+ssize_t receive_request(int sock, char *buf, int *fds) {
+    char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = ZYGOTE_MSG_MAX - 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+        return 0;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), ZYGOTE_FDS * sizeof(int));
+    buf[len] = '\0';
+    return len;
+}
+
+// in the worker: set up the request's descriptors and args, then run main()
+void run_main(int sock, char *buf, ssize_t len, int *fds, char **envp) {
+    close(sock);
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+    if (fchdir(fds[3]) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ZYGOTE_FDS; i++) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+
+    int argc = 0;
+    for (ssize_t i = 0; i < len; i++) {
+        argc += buf[i] == '\0';
+    }
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    char *arg = buf;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    argv[argc] = NULL;
+    exit(real_main(argc, argv, envp));
+}
+
+int zygote_main(int argc, char **argv, char **envp) {
+    char *fd_env = getenv(ZYGOTE_FD_ENV);
+    if (fd_env == NULL) {
+        return real_main(argc, argv, envp);
+    }
+
+    // whatever main() runs shouldn't become a zygote too
+    int sock = atoi(fd_env);
+    unsetenv(ZYGOTE_FD_ENV);
+    unsetenv("LD_PRELOAD");
+
+    char ready = ZYGOTE_READY;
+    if (send(sock, &ready, 1, 0) != 1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    static char buf[ZYGOTE_MSG_MAX];
+    int fds[ZYGOTE_FDS];
+    ssize_t len;
+    while ((len = receive_request(sock, buf, fds)) != 0) {
+        pid_t pid = -1;
+        int pid_pipe[2];
+        if (len > 0 && pipe2(pid_pipe, O_CLOEXEC) == 0) {
+            // fork twice and let the middle process exit, so the worker is
+            // reparented to wish (a subreaper) before wish learns its pid
+            pid_t middle = fork();
+            if (middle == 0) {
+                pid_t worker = fork();
+                if (worker == 0) {
+                    run_main(sock, buf, len, fds, envp);
+                }
+                write(pid_pipe[1], &worker, sizeof(worker));
+                _exit(0);
+            }
+            close(pid_pipe[1]);
+            if (middle > 0) {
+                waitpid(middle, NULL, 0);
+                if (read(pid_pipe[0], &pid, sizeof(pid)) != sizeof(pid)) {
+                    pid = -1;
+                }
+            }
+            close(pid_pipe[0]);
+        }
+        if (len > 0) {
+            for (int i = 0; i < ZYGOTE_FDS; i++) {
+                close(fds[i]);
+            }
+        }
+        if (send(sock, &pid, sizeof(pid), 0) != sizeof(pid)) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+// Every dynamically linked program starts through here once ld.so has
+// loaded and relocated it, run main() through zygote_main() instead
+int __libc_start_main(main_func main, int argc, char **argv, void (*init)(void),
+                      void (*fini)(void), void (*rtld_fini)(void), void *stack_end) {
+    start_main_func start_main = (start_main_func)dlsym(RTLD_NEXT, "__libc_start_main");
+    real_main = main;
+    return start_main(zygote_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
@@ -0,0 +1,23 @@
+#ifndef WISH_ZYGOTE_H
+#define WISH_ZYGOTE_H
+
+// Protocol between wish (-z) and wish-zygote.so, which is preloaded into a
+// command so that, once its shared libraries are loaded and initialized, it
+// parks in front of main() and forks a warm copy of itself per invocation.
+//
+// wish starts the command with LD_PRELOAD set and the zygote's end of a
+// SOCK_SEQPACKET socketpair at the descriptor named by ZYGOTE_FD_ENV.
+//   zygote -> wish  ZYGOTE_READY once it is waiting for requests
+//   wish -> zygote  args separated by NULs, with ZYGOTE_FDS descriptors
+//                   (stdin, stdout, stderr, cwd) attached as SCM_RIGHTS
+//   zygote -> wish  the pid_t of the process running main(), or -1
+// The process running main() is handed to wish (a child subreaper) so wish
+// reaps it like any other child. The zygote exits when wish closes its end.
+
+#define ZYGOTE_FD_ENV "WISH_ZYGOTE_FD"
+#define ZYGOTE_FD 3
+#define ZYGOTE_READY 'R'
+#define ZYGOTE_FDS 4
+#define ZYGOTE_MSG_MAX 65536
+
+#endif
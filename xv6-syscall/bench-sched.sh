@@ -0,0 +1,37 @@
+#! /bin/bash
+
+# Check and measure the scheduler under each policy: usertests must
+# pass booted with 1 and with 8 CPUs, then schedbench gives the
+# context-switch throughput with 1, 2, 4 and 8 CPUs, followed by the
+# per-CPU steal, halt and kick counters from cpustats.
+# Exits non-zero if usertests fails anywhere.
+# usage: ./bench-sched.sh [pairs [rounds]]
+
+if ! [[ -d src ]]; then
+    echo "The src/ dir does not exist."
+    exit 1
+fi
+
+cd src
+status=0
+for sched in MLFQ STRIDE; do
+    # the policy is compiled in, and usertests needs a fresh fs.img
+    make clean > /dev/null
+    for cpus in 1 8; do
+        echo -n "SCHED=$sched CPUS=$cpus usertests: "
+        if SCHED=$sched ./../tester/run-xv6-command.exp CPUS=$cpus Makefile "usertests" \
+               | grep -q '^ALL TESTS PASSED'; then
+            echo "passed"
+        else
+            echo "FAILED"
+            status=1
+        fi
+        rm -f fs.img
+    done
+    for cpus in 1 2 4 8; do
+        echo "SCHED=$sched CPUS=$cpus"
+        SCHED=$sched ./../tester/run-xv6-command.exp CPUS=$cpus Makefile "schedbench $*; cpustats" \
+            | grep -E '^schedbench:|^cpu|^[0-9]+\s'
+    done
+done
+exit $status
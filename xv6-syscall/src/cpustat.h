@@ -0,0 +1,9 @@
+// Per-CPU scheduler counters, see getcpustats().
+struct cpustat {
+  uint steals;       // times this CPU took procs from a busier one
+  uint migrations;   // procs moved to this CPU by its steals
+  uint idleticks;    // timer ticks with nothing to run
+  uint halts;        // times it halted with an empty run queue
+  uint kicks;        // times another CPU woke it to run new work
+  int runnable;      // procs on its run queue now
+};
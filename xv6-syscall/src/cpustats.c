@@ -0,0 +1,28 @@
+// Print the per-CPU scheduler counters: how often each CPU
+// stole work, how many procs it took, how long it idled, how
+// often it halted and how often it was kicked awake.
+
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "cpustat.h"
+
+struct cpustat st[NCPU];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n;
+
+  if((n = getcpustats(st, NCPU)) < 0){
+    printf(2, "cpustats: getcpustats failed\n");
+    exit();
+  }
+  printf(1, "cpu\tsteals\tmigrate\tidle\thalts\tkicks\trunnable\n");
+  for(i = 0; i < n; i++)
+    printf(1, "%d\t%d\t%d\t%d\t%d\t%d\t%d\n", i, st[i].steals,
+           st[i].migrations, st[i].idleticks, st[i].halts, st[i].kicks,
+           st[i].runnable);
+  exit();
+}
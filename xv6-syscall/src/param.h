@@ -11,4 +11,9 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define NPRIO         4  // scheduler priority levels
+#define BOOSTTICKS  100  // ticks between priority boosts
+#define NTICKETS     10  // default tickets of a process
+#define MAXTICKETS 1000  // most tickets a process can hold
+#define STRIDE1  (1<<20)  // stride of a process with one ticket
 
@@ -0,0 +1,62 @@
+// Print the priority level of each process and the timer
+// ticks it has run at every level of the scheduler.
+// With a count, first start that many CPU-bound processes and
+// let them run for a while, to watch them sink to the lowest
+// level while the shell stays on top.
+//
+// usage: pinfo [spinners [ticks]]
+
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pstat.h"
+
+struct pstat st;
+
+static char *states[] = { "unused", "embryo", "sleep", "runble", "run", "zombie" };
+
+int
+main(int argc, char *argv[])
+{
+  int i, lv, n, t;
+  int pids[NPROC];
+  volatile int x = 0;
+
+  n = argc > 1 ? atoi(argv[1]) : 0;
+  t = argc > 2 ? atoi(argv[2]) : 300;
+  if(n < 0 || n > NPROC - 3){
+    printf(2, "usage: pinfo [spinners [ticks]]\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    if((pids[i] = fork()) == 0)
+      for(;;)
+        x++;
+  }
+  if(n > 0)
+    sleep(t);
+
+  if(getpinfo(&st) < 0){
+    printf(2, "pinfo: getpinfo failed\n");
+    exit();
+  }
+  printf(1, "pid\tname\tstate\tprio");
+  for(lv = 0; lv < NPRIO; lv++)
+    printf(1, "\tq%d", lv);
+  printf(1, "\n");
+  for(i = 0; i < NPROC; i++){
+    if(!st.inuse[i])
+      continue;
+    printf(1, "%d\t%s\t%s\t%d", st.pid[i], st.name[i], states[st.state[i]], st.prio[i]);
+    for(lv = 0; lv < NPRIO; lv++)
+      printf(1, "\t%d", st.ticks[i][lv]);
+    printf(1, "\n");
+  }
+
+  for(i = 0; i < n; i++)
+    kill(pids[i]);
+  for(i = 0; i < n; i++)
+    wait();
+  exit();
+}
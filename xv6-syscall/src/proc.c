@@ -4,17 +4,69 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "cpustat.h"
+#include "pstat.h"
+
+#if !defined(SCHED_MLFQ) && !defined(SCHED_STRIDE)
+#error "set SCHED to MLFQ or STRIDE"
+#endif
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
 } ptable;
 
+// Each CPU has a queue of the RUNNABLE procs it will run, so
+// schedulers don't contend for ptable.lock or scan the table.
+// A proc is on a run queue exactly when it is RUNNABLE.
+//
+// The queue is a multi-level feedback queue: one FIFO per
+// priority level, highest level first.  A proc that uses up
+// its level's quantum drops a level (see schedtick()), and
+// every BOOSTTICKS all procs go back to the top (see boost()),
+// so CPU-bound procs sink below interactive ones but don't
+// starve.  A proc's level is only changed by the CPU running it
+// or under the lock of the run queue it is on.
+//
+// With SCHED_STRIDE only level 0 is used, kept sorted by pass.
+// Each tick a proc runs adds its stride, STRIDE1 / tickets, to
+// its pass, and the proc with the lowest pass runs next, so
+// procs on a CPU share it in proportion to their tickets.
+//
+// The run queue lock of a CPU, not ptable.lock, is held across
+// swtch() between a process and that CPU's scheduler.  A proc
+// going to sleep or exiting takes its CPU's run queue lock
+// before releasing ptable.lock, and wakeup1() puts a proc back
+// on the queue of the CPU it last ran on, so it can't be run
+// again until it has switched away.  A CPU with an empty queue
+// steals from the busiest one (see steal()), and if there is
+// nothing to steal it halts until an interrupt (see idle()).
+// Lock order: ptable.lock, then run queue locks by address.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int len;
+  uint pass;                   // pass of the proc last taken
+};
+
+struct runq runqs[NCPU];
+
+#ifdef SCHED_MLFQ
+// Time slice of each priority level, in timer ticks.
+static int quantum[NPRIO] = { 1, 2, 4, 8 };
+
+// Number of priority boosts so far.  Only boost() changes it.
+static uint boosts;
+#endif
+
 static struct proc *initproc;
 
 int nextpid = 1;
+static int nextcpu;
 extern void forkret(void);
 extern void trapret(void);
 
@@ -23,7 +75,139 @@ static void wakeup1(void *chan);
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
+}
+
+// Pass values wrap around; compare them by their difference.
+#define PASS_BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+#ifdef SCHED_MLFQ
+// Give p a boost it has missed while it was running or asleep.
+// p must be running on this CPU, or be off the CPUs with the
+// lock of the run queue it is on or going onto held.
+static void
+catchup(struct proc *p)
+{
+  if(p->boosted != boosts){
+    p->boosted = boosts;
+    p->prio = 0;
+    p->slice = 0;
+  }
+}
+
+// Append p to the level p->prio of rq, whose lock must be held,
+// and make it RUNNABLE.
+static void
+runq_push(struct runq *rq, struct proc *p)
+{
+  int lv;
+
+  catchup(p);
+  lv = p->prio;
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  if(rq->tail[lv])
+    rq->tail[lv]->rqnext = p;
+  else
+    rq->head[lv] = p;
+  rq->tail[lv] = p;
+  rq->len++;
+}
+#else
+// Insert p into level 0 of rq, whose lock must be held, after
+// the procs with a lower or equal pass, and make it RUNNABLE.
+// A proc coming back from sleep or from another CPU starts no
+// earlier than the proc last taken, so it can't claim the CPU
+// for the time it was away.
+static void
+runq_push(struct runq *rq, struct proc *p)
+{
+  struct proc **pp;
+
+  p->state = RUNNABLE;
+  if(PASS_BEFORE(p->pass, rq->pass))
+    p->pass = rq->pass;
+  for(pp = &rq->head[0]; *pp && !PASS_BEFORE(p->pass, (*pp)->pass);
+      pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+  if(p->rqnext == 0)
+    rq->tail[0] = p;
+  rq->len++;
+}
+#endif
+
+// Remove and return the first proc of the highest non-empty
+// level of rq, whose lock must be held, or 0 if it is empty.
+static struct proc*
+runq_pop(struct runq *rq)
+{
+  struct proc *p;
+  int lv;
+
+  for(lv = 0; lv < NPRIO; lv++){
+    if((p = rq->head[lv]) == 0)
+      continue;
+    rq->head[lv] = p->rqnext;
+    if(rq->head[lv] == 0)
+      rq->tail[lv] = 0;
+    p->rqnext = 0;
+    rq->len--;
+    rq->pass = p->pass;
+    return p;
+  }
+  return 0;
+}
+
+// Wake the halted CPU cpu with an IPI.
+// Must be called with interrupts disabled.
+static void
+kick(int cpu)
+{
+  if(cpu != cpuid())
+    lapicipi(cpus[cpu].apicid, T_IRQ0 + IRQ_KICK);
+}
+
+// Make p RUNNABLE on the run queue of cpu, and wake a halted
+// CPU to run it: cpu itself, or if that one is busy, another
+// one that can steal p instead of waiting for its next tick.
+// A CPU about to halt checks every queue after setting its idle
+// flag (see idle()), so if no flag is seen here, that check
+// will find p.
+// Must be called with interrupts disabled.
+static void
+enqueue(struct proc *p, int cpu)
+{
+  struct runq *rq = &runqs[cpu];
+  int i;
+
+  acquire(&rq->lock);
+  runq_push(rq, p);
+  // release() is a full barrier, so the reads of idle below
+  // can't be done before p is visible on the queue.
+  release(&rq->lock);
+  if(cpus[cpu].idle){
+    kick(cpu);
+    return;
+  }
+  for(i = 0; i < ncpu; i++)
+    if(cpus[i].idle){
+      kick(i);
+      return;
+    }
+}
+
+// The run queue of the current CPU.
+// Must be called with interrupts disabled.
+static struct runq*
+myrunq(void)
+{
+  return &runqs[cpuid()];
 }
 
 // Must be called with interrupts disabled
@@ -89,6 +273,16 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->reads = 0;
+  p->prio = 0;
+  p->slice = 0;
+  memset(p->pticks, 0, sizeof(p->pticks));
+#ifdef SCHED_MLFQ
+  p->boosted = boosts;
+#endif
+  p->ticks = 0;
+  p->tickets = NTICKETS;
+  p->stride = STRIDE1 / NTICKETS;
+  p->pass = 0;
 
   release(&ptable.lock);
 
@@ -143,13 +337,12 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  // this assignment to p->state lets other cores
-  // run this process. the acquire forces the above
-  // writes to be visible, and the lock is also needed
-  // because the assignment might not be atomic.
+  // queueing p lets other cores run this process.
+  // the acquire forces the above writes to be visible.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  p->cpu = 0;
+  enqueue(p, 0);
 
   release(&ptable.lock);
 }
@@ -211,11 +404,19 @@ fork(void)
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
+  // The child inherits its parent's share and virtual time.
+  np->tickets = curproc->tickets;
+  np->stride = curproc->stride;
+  np->pass = curproc->pass;
+
   pid = np->pid;
 
+  // New processes are spread round-robin over the CPUs.
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  np->cpu = nextcpu;
+  enqueue(np, nextcpu);
+  nextcpu = (nextcpu + 1) % ncpu;
 
   release(&ptable.lock);
 
@@ -263,7 +464,11 @@ exit(void)
   }
 
   // Jump into the scheduler, never to return.
+  // wait() won't free our stack until our CPU's run
+  // queue lock shows we have switched away from it.
+  acquire(&myrunq()->lock);
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -286,7 +491,9 @@ wait(void)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
-        // Found one.
+        // Found one.  Wait for it to be off its CPU.
+        acquire(&runqs[p->cpu].lock);
+        release(&runqs[p->cpu].lock);
         pid = p->pid;
         kfree(p->kstack);
         p->kstack = 0;
@@ -312,6 +519,84 @@ wait(void)
   }
 }
 
+// Called by a CPU with nothing to run: move half of the
+// busiest CPU's run queue to ours.  Procs that last ran on
+// some other CPU go first, since they have no cache on the
+// busy one to lose; then the ones that have waited longest.
+// Higher levels are taken before lower ones.
+static void
+steal(struct cpu *c)
+{
+  struct runq *rq = &runqs[c - cpus];
+  struct runq *victim = 0;
+  struct proc **pp, *p;
+  int i, n, pass, lv;
+
+  // Lengths are read without locks to pick the victim, and
+  // checked again once both queues are locked.
+  for(i = 0; i < ncpu; i++)
+    if(&runqs[i] != rq && runqs[i].len > 0
+       && (victim == 0 || runqs[i].len > victim->len))
+      victim = &runqs[i];
+  if(victim == 0)
+    return;
+
+  acquire(rq < victim ? &rq->lock : &victim->lock);
+  acquire(rq < victim ? &victim->lock : &rq->lock);
+  n = (victim->len + 1) / 2;
+  if(rq->len == 0 && n > 0){
+    c->steals++;
+    for(pass = 0; pass < 2; pass++){
+      for(lv = 0; lv < NPRIO; lv++){
+        pp = &victim->head[lv];
+        while(*pp && n > 0){
+          p = *pp;
+          if(pass == 0 && p->cpu == victim - runqs){
+            pp = &p->rqnext;
+            continue;
+          }
+          *pp = p->rqnext;
+          victim->len--;
+          runq_push(rq, p);
+          c->migrations++;
+          n--;
+        }
+      }
+    }
+    for(lv = 0; lv < NPRIO; lv++){
+      victim->tail[lv] = 0;
+      for(p = victim->head[lv]; p; p = p->rqnext)
+        victim->tail[lv] = p;
+    }
+  }
+  release(&victim->lock);
+  release(&rq->lock);
+}
+
+// Halt c until an interrupt, as no run queue had work for it.
+// A CPU queueing work onto any queue kicks a halted CPU with an
+// IPI (see enqueue()).  idle is set with xchg, a full barrier,
+// before all the queues are checked again, and enqueue() reads
+// the flags after the new proc is on its queue.  So either we
+// see the proc here and don't halt, or enqueue() sees our flag,
+// or that of another halted CPU, and kicks it.
+static void
+idle(struct cpu *c)
+{
+  struct runq *rq;
+
+  cli();
+  xchg(&c->idle, 1);
+  for(rq = runqs; rq < &runqs[ncpu]; rq++)
+    if(rq->len > 0)
+      break;
+  if(rq == &runqs[ncpu]){
+    c->halts++;
+    stihlt();
+  }
+  c->idle = 0;
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -325,22 +610,24 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *rq = &runqs[c - cpus];
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
+    // Take the first process of the highest level of this
+    // CPU's run queue, after stealing some if it is empty.
+    if(rq->len == 0)
+      steal(c);
+    acquire(&rq->lock);
+    if((p = runq_pop(rq)) != 0){
       // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
+      // to release rq->lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
+      p->cpu = c - cpus;
       switchuvm(p);
       p->state = RUNNING;
 
@@ -350,13 +637,18 @@ scheduler(void)
       // Process is done running for now.
       // It should have changed its p->state before coming back.
       c->proc = 0;
+      release(&rq->lock);
+      continue;
     }
-    release(&ptable.lock);
+    release(&rq->lock);
 
+    // Nothing to run or steal: rather than spinning, sleep
+    // until a timer tick or a kick from a CPU with new work.
+    idle(c);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only this CPU's run queue lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -369,8 +661,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&myrunq()->lock))
+    panic("sched runq lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -386,10 +678,118 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct runq *rq;
+
+  pushcli();
+  rq = myrunq();
+  acquire(&rq->lock);  //DOC: yieldlock
+  popcli();
+  runq_push(rq, myproc());
   sched();
-  release(&ptable.lock);
+  release(&myrunq()->lock);
+}
+
+#ifdef SCHED_MLFQ
+// Charge a timer tick to the running process.  Returns whether
+// it should yield: either it has used up its quantum, and then
+// drops a level, or a higher level process is waiting.
+// Time spent sleeping keeps the part of the quantum already
+// used, so a process can't stay on top by sleeping just before
+// its quantum ends.
+int
+schedtick(void)
+{
+  struct proc *p;
+  struct runq *rq;
+  int lv;
+
+  pushcli();
+  p = myproc();
+  rq = myrunq();
+  catchup(p);
+  p->ticks++;
+  p->pticks[p->prio]++;
+  if(++p->slice >= quantum[p->prio]){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    popcli();
+    return 1;
+  }
+  // Peeking without the lock can only make the yield
+  // a tick early or late.
+  for(lv = 0; lv < p->prio; lv++)
+    if(rq->head[lv]){
+      popcli();
+      return 1;
+    }
+  popcli();
+  return 0;
+}
+
+// Move every process back to the highest level, so CPU-bound
+// ones that sank to the bottom still get to run.  Called from
+// the timer interrupt every BOOSTTICKS.  Only queued processes
+// are moved here, under their queue's lock; running and
+// sleeping ones catch up in schedtick() or when next queued.
+void
+boost(void)
+{
+  struct runq *rq;
+  struct proc *p;
+  int lv;
+
+  boosts++;
+  // Queued processes are appended to level 0 in priority order.
+  for(rq = runqs; rq < &runqs[ncpu]; rq++){
+    acquire(&rq->lock);
+    for(lv = 0; lv < NPRIO; lv++)
+      for(p = rq->head[lv]; p; p = p->rqnext)
+        catchup(p);
+    for(lv = 1; lv < NPRIO; lv++){
+      if(rq->head[lv] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rqnext = rq->head[lv];
+      else
+        rq->head[0] = rq->head[lv];
+      rq->tail[0] = rq->tail[lv];
+      rq->head[lv] = rq->tail[lv] = 0;
+    }
+    release(&rq->lock);
+  }
+}
+#else
+// Charge a timer tick to the running process by advancing its
+// pass.  It yields every tick, so whichever proc now has the
+// lowest pass runs next.
+int
+schedtick(void)
+{
+  struct proc *p;
+
+  pushcli();
+  p = myproc();
+  p->ticks++;
+  p->pticks[0]++;
+  p->pass += p->stride;
+  popcli();
+  return 1;
+}
+#endif
+
+// Set the number of tickets of the current process, which
+// sets its share of its CPU under SCHED_STRIDE.
+int
+settickets(int n)
+{
+  struct proc *p = myproc();
+
+  if(n < 1 || n > MAXTICKETS)
+    return -1;
+  p->tickets = n;
+  p->stride = STRIDE1 / n;
+  return 0;
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -398,8 +798,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding the run queue lock from scheduler.
+  release(&myrunq()->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -440,16 +840,18 @@ sleep(void *chan, struct spinlock *lk)
   p->chan = chan;
   p->state = SLEEPING;
 
+  // A wakeup from now on waits for our run queue lock,
+  // which is released once we have switched away.
+  acquire(&myrunq()->lock);
+  release(&ptable.lock);
   sched();
+  release(&myrunq()->lock);
 
   // Tidy up.
   p->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 //PAGEBREAK!
@@ -462,7 +864,7 @@ wakeup1(void *chan)
 
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
     if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+      enqueue(p, p->cpu);
 }
 
 // Wake up all processes sleeping on chan.
@@ -488,7 +890,7 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        enqueue(p, p->cpu);
       release(&ptable.lock);
       return 0;
     }
@@ -497,6 +899,48 @@ kill(int pid)
   return -1;
 }
 
+// Copy the scheduler counters of up to n CPUs into st.
+// Returns the number of CPUs.
+int
+getcpustats(struct cpustat *st, int n)
+{
+  int i;
+
+  for(i = 0; i < ncpu && i < n; i++){
+    st[i].steals = cpus[i].steals;
+    st[i].migrations = cpus[i].migrations;
+    st[i].idleticks = cpus[i].idleticks;
+    st[i].halts = cpus[i].halts;
+    st[i].kicks = cpus[i].kicks;
+    st[i].runnable = runqs[i].len;
+  }
+  return ncpu;
+}
+
+// Fill in st with the state, priority level and ticks run at
+// each level of every process slot.
+int
+getpinfo(struct pstat *st)
+{
+  struct proc *p;
+  int i;
+
+  acquire(&ptable.lock);
+  for(i = 0; i < NPROC; i++){
+    p = &ptable.proc[i];
+    st->inuse[i] = p->state != UNUSED;
+    st->pid[i] = p->pid;
+    st->state[i] = p->state;
+    st->prio[i] = p->prio;
+    st->tickets[i] = p->tickets;
+    st->runticks[i] = p->ticks;
+    safestrcpy(st->name[i], p->name, sizeof(st->name[i]));
+    memmove(st->ticks[i], p->pticks, sizeof(st->ticks[i]));
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -8,6 +8,12 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  uint steals;                 // Work stealing counters, see cpustat.h
+  uint migrations;
+  uint idleticks;
+  volatile uint idle;          // Halted in idle(), waiting for a kick
+  uint halts;                  // Idle counters, see cpustat.h
+  uint kicks;
 };
 
 extern struct cpu cpus[NCPU];
@@ -50,6 +56,16 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int reads;                   // Number of read system calls
+  int cpu;                     // CPU it last ran on (cache affinity hint)
+  struct proc *rqnext;         // Next proc in that run queue
+  int prio;                    // Priority level, 0 is highest
+  int slice;                   // Ticks used of this level's quantum
+  uint pticks[NPRIO];          // Ticks run at each level
+  uint boosted;                // Priority boosts applied so far
+  uint ticks;                  // Ticks run in total
+  int tickets;                 // Share of the CPU under SCHED_STRIDE
+  uint stride;                 // STRIDE1 / tickets
+  uint pass;                   // Virtual time, next to run is lowest
 };
 
 // Process memory is laid out contiguously, low addresses first:
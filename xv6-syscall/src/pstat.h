@@ -0,0 +1,12 @@
+// Per-process scheduler state, see getpinfo().
+// Needs param.h for NPROC and NPRIO.
+struct pstat {
+  int inuse[NPROC];          // whether this slot of the process table is in use
+  int pid[NPROC];            // PID of each process
+  int state[NPROC];          // its enum procstate
+  int prio[NPROC];           // its current priority level, 0 is highest
+  int tickets[NPROC];        // its tickets, see settickets()
+  uint runticks[NPROC];      // timer ticks it has run in total
+  char name[NPROC][16];      // its name
+  uint ticks[NPROC][NPRIO];  // timer ticks it has run at each level
+};
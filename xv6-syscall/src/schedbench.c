@@ -0,0 +1,70 @@
+// Context-switch throughput benchmark.
+// Pairs of processes pass a byte back and forth over two pipes,
+// so each round trip is two sleeps, two wakeups and at least two
+// context switches.  Run it with CPUS=1, 2, 4 and 8 (see
+// bench-sched.sh) to see how switching scales with CPUs.
+//
+// usage: schedbench [pairs [rounds]]
+
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// one side of a pair: send first if ping, then echo back rounds times
+void
+player(int in, int out, int rounds, int ping)
+{
+  char c = 0;
+  int i;
+
+  for(i = 0; i < rounds; i++){
+    if(ping && write(out, &c, 1) != 1)
+      break;
+    if(read(in, &c, 1) != 1)
+      break;
+    if(!ping && write(out, &c, 1) != 1)
+      break;
+  }
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pairs, rounds, i, start, elapsed;
+  int to[2], from[2];
+
+  pairs = argc > 1 ? atoi(argv[1]) : 8;
+  rounds = argc > 2 ? atoi(argv[2]) : 2000;
+  if(pairs < 1 || rounds < 1 || 2 * pairs + 3 > NPROC){
+    printf(2, "usage: schedbench [pairs [rounds]]\n");
+    exit();
+  }
+
+  start = uptime();
+  for(i = 0; i < pairs; i++){
+    if(pipe(to) < 0 || pipe(from) < 0){
+      printf(2, "schedbench: pipe failed\n");
+      exit();
+    }
+    if(fork() == 0)
+      player(from[0], to[1], rounds, 1);
+    if(fork() == 0)
+      player(to[0], from[1], rounds, 0);
+    close(to[0]);
+    close(to[1]);
+    close(from[0]);
+    close(from[1]);
+  }
+  for(i = 0; i < 2 * pairs; i++)
+    wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+
+  // ticks are 10ms
+  printf(1, "schedbench: %d pairs, %d round trips in %d ticks, %d switches/sec\n",
+         pairs, pairs * rounds, elapsed, 2 * pairs * rounds * 100 / elapsed);
+  exit();
+}
@@ -0,0 +1,94 @@
+// Measure the CPU shares achieved by settickets().
+// Starts one CPU-bound child per argument, holding that many
+// tickets, and every INTERVAL ticks prints the ticks each child
+// ran in that interval and its percentage of their total.  Under
+// SCHED_STRIDE the percentages should follow the tickets.
+// Shares are kept per CPU, so build with CPUS=1 to compare
+// all the children against each other.
+//
+// usage: stridetest [tickets...]
+
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pstat.h"
+
+#define ROUNDS    5
+#define INTERVAL  100
+
+struct pstat st;
+
+// ticks run so far by the process pid, or -1 if it is gone
+int
+runticks(int pid)
+{
+  int i;
+
+  for(i = 0; i < NPROC; i++)
+    if(st.inuse[i] && st.pid[i] == pid)
+      return st.runticks[i];
+  return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pids[NPROC], tickets[NPROC], last[NPROC], delta[NPROC];
+  int n, i, r, t, total;
+  volatile int x = 0;
+
+  n = 0;
+  for(i = 1; i < argc && n < NPROC - 3; i++)
+    if((tickets[n++] = atoi(argv[i])) < 1 || tickets[n-1] > MAXTICKETS){
+      printf(2, "usage: stridetest [tickets...]\n");
+      exit();
+    }
+  if(n == 0){
+    tickets[n++] = 100;
+    tickets[n++] = 200;
+    tickets[n++] = 300;
+  }
+
+  // Outrank the children so the samples are taken on time.
+  settickets(MAXTICKETS);
+  for(i = 0; i < n; i++){
+    if((pids[i] = fork()) == 0){
+      settickets(tickets[i]);
+      for(;;)
+        x++;
+    }
+    last[i] = 0;
+  }
+
+  printf(1, "tickets");
+  for(i = 0; i < n; i++)
+    printf(1, "\t%d", tickets[i]);
+  printf(1, "\n");
+  for(r = 0; r < ROUNDS; r++){
+    sleep(INTERVAL);
+    getpinfo(&st);
+    total = 0;
+    for(i = 0; i < n; i++){
+      t = runticks(pids[i]);
+      delta[i] = t < 0 ? 0 : t - last[i];
+      last[i] = t;
+      total += delta[i];
+    }
+    if(total == 0)
+      total = 1;
+    printf(1, "ticks");
+    for(i = 0; i < n; i++)
+      printf(1, "\t%d", delta[i]);
+    printf(1, "\n%%");
+    for(i = 0; i < n; i++)
+      printf(1, "\t%d", delta[i] * 100 / total);
+    printf(1, "\n");
+  }
+
+  for(i = 0; i < n; i++)
+    kill(pids[i]);
+  for(i = 0; i < n; i++)
+    wait();
+  exit();
+}
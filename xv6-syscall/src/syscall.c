@@ -104,6 +104,9 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_getreadcount(void);
+extern int sys_getcpustats(void);
+extern int sys_getpinfo(void);
+extern int sys_settickets(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -128,6 +131,9 @@ static int (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_getreadcount]   sys_getreadcount,
+[SYS_getcpustats]    sys_getcpustats,
+[SYS_getpinfo]       sys_getpinfo,
+[SYS_settickets]     sys_settickets,
 };
 
 int readcount = 0;
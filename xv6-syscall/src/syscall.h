@@ -21,3 +21,6 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_getreadcount  22
+#define SYS_getcpustats   23
+#define SYS_getpinfo      24
+#define SYS_settickets    25
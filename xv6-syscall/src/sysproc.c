@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "cpustat.h"
+#include "pstat.h"
 
 int
 sys_fork(void)
@@ -96,3 +98,42 @@ sys_getreadcount(void)
   return myproc()->reads;
 }
 
+// copy the scheduler counters of up to n CPUs to user space
+int
+sys_getcpustats(void)
+{
+  struct cpustat *st;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  // Only ncpu entries are written; clamping first also keeps
+  // the size checked by argptr from overflowing.
+  if(n > ncpu)
+    n = ncpu;
+  if(argptr(0, (void*)&st, n * sizeof(*st)) < 0)
+    return -1;
+  return getcpustats(st, n);
+}
+
+// copy the state and per-level ticks of every process to user space
+int
+sys_getpinfo(void)
+{
+  struct pstat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  return getpinfo(st);
+}
+
+// set the calling process's share of the CPU
+int
+sys_settickets(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return settickets(n);
+}
@@ -53,7 +53,19 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+#ifdef SCHED_MLFQ
+      if(ticks % BOOSTTICKS == 0)
+        boost();
+#endif
     }
+    if(myproc() == 0)
+      mycpu()->idleticks++;
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_KICK:
+    // Woken from idle() to run new work; the scheduler
+    // looks at its run queue again once we return.
+    mycpu()->kicks++;
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -100,10 +112,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Charge the clock tick to the process, and make it give up
+  // the CPU once its quantum is used up (see schedtick()).
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER && schedtick())
     yield();
 
   // Check if the process has been killed since we yielded
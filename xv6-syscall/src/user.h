@@ -1,5 +1,7 @@
 struct stat;
 struct rtcdate;
+struct cpustat;
+struct pstat;
 
 // system calls
 int fork(void);
@@ -24,6 +26,9 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int getreadcount(void);
+int getcpustats(struct cpustat*, int);
+int getpinfo(struct pstat*);
+int settickets(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
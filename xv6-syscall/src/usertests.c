@@ -7,6 +7,7 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "cpustat.h"
 
 char buf[8192];
 char name[3];
@@ -1589,6 +1590,31 @@ validatetest(void)
   printf(stdout, "validate ok\n");
 }
 
+// getcpustats() only writes ncpu entries, so a larger count is
+// reduced to ncpu before the buffer is checked.  A count whose
+// size in bytes wraps around to a few bytes must still have
+// its ncpu entries checked, not the bytes it wraps to.
+struct cpustat cpustat[NCPU];
+void
+cpustatstest(void)
+{
+  uint wrapped;
+  int n;
+
+  printf(stdout, "cpustats test\n");
+  n = 0xFFFFFFFF / sizeof(struct cpustat) + 1;
+  if(getcpustats(cpustat, n) < 1){
+    printf(stdout, "getcpustats with a large count failed\n");
+    exit();
+  }
+  wrapped = n * sizeof(struct cpustat);
+  if(getcpustats((struct cpustat*)(sbrk(0) - wrapped), n) != -1){
+    printf(stdout, "getcpustats wrote past the end of memory\n");
+    exit();
+  }
+  printf(stdout, "cpustats ok\n");
+}
+
 // does unintialized data start out zero?
 char uninit[10000];
 void
@@ -1769,6 +1795,7 @@ main(int argc, char *argv[])
   bsstest();
   sbrktest();
   validatetest();
+  cpustatstest();
 
   opentest();
   writetest();